@@ -0,0 +1,202 @@
+/*
+    ntlddbench - times libntldd over a corpus of images
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Builds and prints the dependency tree of one file a number of times,
+the way ntldd does, and reports how fast each of the two phases went.
+The output itself is written to /dev/null. Meant for the corpora that
+pegen writes, but works on any image.
+*/
+
+#define NTLDD_NO_MAIN
+#include "../ntldd.c"
+
+#include <time.h>
+#include <sys/resource.h>
+
+static double Now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Counts every module of the tree once, along with its imports */
+static void CountModules (struct DepTreeElement *self, uint64_t *modules, uint64_t *imports)
+{
+  uint64_t i;
+  if (self->flags & DEPTREE_VISITED)
+    return;
+  self->flags |= DEPTREE_VISITED;
+  *modules += 1;
+  *imports += self->imports_len;
+  for (i = 0; i < self->childs_len; i++)
+    CountModules (self->childs[i], modules, imports);
+}
+
+static void PrintRate (const char *phase, double seconds, int iterations, uint64_t modules, uint64_t imports)
+{
+  printf ("%-6s %10.3f ms/iter %14.0f modules/s %14.0f imports/s\n", phase,
+      seconds * 1000 / iterations, modules * (double) iterations / seconds,
+      imports * (double) iterations / seconds);
+}
+
+void printbenchhelp (char *argv0)
+{
+  printf ("Usage: %s [OPTION]... FILE\n\
+OPTIONS:\n\
+-n N           Repeat N times (default 10)\n\
+-R             Build the whole tree, like ntldd -R (the default)\n\
+-1             Only the direct dependencies of FILE\n\
+-i             Print imports too, like ntldd -i\n\
+-e             Print exports too, like ntldd -e\n\
+-j N           Parse modules on N threads\n\
+-D DIR         Search DIR too, like ntldd -D\n\
+--compact      Keep exports and imports compact, like ntldd --compact\n\
+--apiset FILE  Resolve API Set contracts with FILE, like ntldd --apiset\n\
+--loader NAME  Load images with the named loader\n", argv0);
+}
+
+int main (int argc, char **argv)
+{
+  int i, n, iterations = 10, list_imports = 0, list_exports = 0;
+  char dir[MAX_PATH];
+  char *file = NULL;
+  double build_time = 0, print_time = 0;
+  uint64_t modules = 0, imports = 0, tree_bytes = 0;
+  struct rusage usage;
+  Session *session = NewSession ();
+
+  if (session == NULL)
+  {
+    fprintf (stderr, "Out of memory\n");
+    return 1;
+  }
+  session->recursive = 1;
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp (argv[i], "-n") == 0 && i + 1 < argc)
+      iterations = atoi (argv[++i]);
+    else if (strcmp (argv[i], "-R") == 0)
+      session->recursive = 1;
+    else if (strcmp (argv[i], "-1") == 0)
+      session->recursive = 0;
+    else if (strcmp (argv[i], "-i") == 0)
+      list_imports = 1;
+    else if (strcmp (argv[i], "-e") == 0)
+      list_exports = 1;
+    else if (strcmp (argv[i], "-j") == 0 && i + 1 < argc)
+      session->jobs = atoi (argv[++i]);
+    else if (strcmp (argv[i], "-D") == 0 && i + 1 < argc)
+      SessionAddSearchPath (session, argv[++i]);
+    else if (strcmp (argv[i], "--compact") == 0)
+      session->compact = 1;
+    else if (strcmp (argv[i], "--apiset") == 0 && i + 1 < argc)
+    {
+      FreeApiSetSchema (session->apiset);
+      session->apiset = LoadApiSetSchema (argv[++i]);
+      if (session->apiset == NULL)
+      {
+        fprintf (stderr, "Could not read the API Set schema `%s'\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (strcmp (argv[i], "--loader") == 0 && i + 1 < argc)
+    {
+      ImageLoader *named = GetImageLoader (argv[++i]);
+      if (named == NULL)
+      {
+        fprintf (stderr, "Unknown image loader `%s'\n", argv[i]);
+        return 1;
+      }
+      session->loader = *named;
+    }
+    else if (argv[i][0] != '-' && file == NULL)
+      file = argv[i];
+    else
+    {
+      printbenchhelp (argv[0]);
+      return 1;
+    }
+  }
+  if (file == NULL || iterations < 1 || session->jobs < 1)
+  {
+    printbenchhelp (argv[0]);
+    return 1;
+  }
+  mydirname (file, dir);
+  SessionAddSearchPath (session, dir);
+
+  fp = fopen ("/dev/null", "w");
+  if (fp == NULL)
+  {
+    fprintf (stderr, "Could not open /dev/null\n");
+    return 1;
+  }
+
+  /* Build the tree the way ntldd does, forwarders included */
+  session->resolve_forwards = list_imports;
+  for (n = 0; n < iterations; n++)
+  {
+    double start;
+    struct DepTreeElement *root, *child;
+
+    start = Now ();
+    root = SessionBuildTree (session, &file, 1);
+    build_time += Now () - start;
+    if (root == NULL)
+    {
+      fprintf (stderr, "Out of memory\n");
+      return 1;
+    }
+    child = root->childs[0];
+
+    if (n == 0)
+    {
+      if (child->flags & DEPTREE_UNRESOLVED)
+      {
+        fprintf (stderr, "Could not load %s\n", file);
+        return 1;
+      }
+      CountModules (child, &modules, &imports);
+      tree_bytes = GetDepTreeBytes (root);
+    }
+
+    start = Now ();
+    ClearDepStatus (root, DEPTREE_VISITED | DEPTREE_PROCESSED);
+    PrintImageLinks (1, 0, 0, 0, 0, child, session->recursive, list_exports, 0, list_imports, 0);
+    OutFlush ();
+    fflush (fp);
+    print_time += Now () - start;
+
+    SessionReleaseTree (session);
+  }
+  fclose (fp);
+
+  getrusage (RUSAGE_SELF, &usage);
+  printf ("%s: %" I64PF "u modules, %" I64PF "u imports, %d iterations\n", file,
+      (U64_TYPE) modules, (U64_TYPE) imports, iterations);
+  PrintRate ("build", build_time, iterations, modules, imports);
+  PrintRate ("print", print_time, iterations, modules, imports);
+  PrintRate ("total", build_time + print_time, iterations, modules, imports);
+  printf ("tree %" I64PF "u KiB, peak RSS %ld KiB\n", (U64_TYPE) (tree_bytes / 1024), usage.ru_maxrss);
+  printf ("%s loader: %" I64PF "u KiB mapped, %" I64PF "u KiB read per iteration\n", session->loader.name,
+      (U64_TYPE) (session->loader.bytes_mapped / iterations / 1024), (U64_TYPE) (session->loader.bytes_read / iterations / 1024));
+
+  DestroySession (session);
+  return 0;
+}
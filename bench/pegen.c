@@ -0,0 +1,529 @@
+/*
+    pegen - writes a synthetic set of PE images for benchmarking ntldd
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+The images are laid out in depth levels of width modules each. Every
+module of a level imports from fanout modules of the next level, and
+app.exe imports from every module of the first level. Each image has
+a .text section, sections - 2 uninitialized ones, and an .rdata
+section that holds the export, import and delay-import tables.
+Nothing in them is meant to run, and nothing reads .text, which is
+padded to the given size so that loaders that only read what is
+looked at have something to skip.
+
+The forwarders of the first level lead to API Set contracts, the way
+kernel32's lead to api-ms-win-core-*, and apiset.bin (to be passed to
+--apiset) makes each contract resolve to a module of the second level.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_ALIGNMENT    0x200
+#define SECTION_ALIGNMENT 0x1000
+
+typedef struct PeGenConfig_t
+{
+  int bits;
+  int width;
+  int depth;
+  int fanout;
+  int exports;
+  int imports;
+  int delay;
+  int forwarders;
+  int sections;
+  /* Size of .text in KiB */
+  int text;
+} PeGenConfig;
+
+/* Growable little-endian byte buffer, addressed by RVA */
+typedef struct ByteBuf_t
+{
+  unsigned char *data;
+  size_t len;
+  size_t size;
+  unsigned long base;
+} ByteBuf;
+
+static void Reserve (ByteBuf *b, size_t len)
+{
+  if (b->len + len <= b->size)
+    return;
+  while (b->len + len > b->size)
+    b->size = b->size > 0 ? b->size * 2 : 4096;
+  b->data = (unsigned char *) realloc (b->data, b->size);
+}
+
+static unsigned long Here (ByteBuf *b)
+{
+  return b->base + (unsigned long) b->len;
+}
+
+static unsigned long PutZeros (ByteBuf *b, size_t len)
+{
+  unsigned long rva = Here (b);
+  Reserve (b, len);
+  memset (&b->data[b->len], 0, len);
+  b->len += len;
+  return rva;
+}
+
+static void Pad (ByteBuf *b, size_t align)
+{
+  if (b->len % align != 0)
+    PutZeros (b, align - b->len % align);
+}
+
+static unsigned long PutString (ByteBuf *b, const char *s)
+{
+  unsigned long rva = Here (b);
+  size_t len = strlen (s) + 1;
+  Reserve (b, len);
+  memcpy (&b->data[b->len], s, len);
+  b->len += len;
+  return rva;
+}
+
+static void Set16 (ByteBuf *b, unsigned long rva, unsigned v)
+{
+  unsigned char *p = &b->data[rva - b->base];
+  p[0] = (unsigned char) v;
+  p[1] = (unsigned char) (v >> 8);
+}
+
+static void Set32 (ByteBuf *b, unsigned long rva, unsigned long v)
+{
+  Set16 (b, rva, (unsigned) (v & 0xffff));
+  Set16 (b, rva + 2, (unsigned) ((v >> 16) & 0xffff));
+}
+
+static void Set64 (ByteBuf *b, unsigned long rva, unsigned long long v)
+{
+  Set32 (b, rva, (unsigned long) (v & 0xffffffffUL));
+  Set32 (b, rva + 4, (unsigned long) (v >> 32));
+}
+
+static void ModuleName (char *buf, int level, int index)
+{
+  sprintf (buf, "L%02dM%04d.dll", level, index);
+}
+
+/* The contract that resolves to module index of the second level.
+ * The schema leaves out the last "-0" when looking it up.
+ */
+static void ContractName (char *buf, int index)
+{
+  sprintf (buf, "api-ms-win-pegen-m%04d-l1-1-0.dll", index);
+}
+
+static unsigned long PutUtf16 (ByteBuf *b, const char *s, unsigned long *len)
+{
+  unsigned long rva = Here (b);
+  size_t i;
+  for (i = 0; s[i] != '\0'; i++)
+    Set16 (b, PutZeros (b, 2), (unsigned char) s[i]);
+  *len = 2 * (unsigned long) i;
+  return rva;
+}
+
+/* Writes one thunk array for syms_len names exported by dll_index,
+ * starting at first; every eighth import is by ordinal, and another
+ * eighth names one of the forwarders of the module, if it has any
+ */
+static unsigned long PutThunks (ByteBuf *b, const PeGenConfig *cfg, int first, int syms_len, int forwarders)
+{
+  unsigned long *entries = (unsigned long *) malloc (sizeof (unsigned long) * (syms_len + 1));
+  int ptr = cfg->bits == 64 ? 8 : 4;
+  unsigned long rva;
+  int i;
+
+  for (i = 0; i < syms_len; i++)
+  {
+    int sym = (first + i) % cfg->exports;
+    if (i % 8 == 7)
+      entries[i] = 0;
+    else
+    {
+      char name[32];
+      Pad (b, 2);
+      entries[i] = PutZeros (b, 2);
+      if (i % 8 == 3 && forwarders > 0)
+        sprintf (name, "Fwd%05d", (first + i) % forwarders);
+      else
+        sprintf (name, "Fn%05d", sym);
+      PutString (b, name);
+    }
+  }
+  Pad (b, 8);
+  rva = PutZeros (b, (size_t) ptr * (syms_len + 1));
+  for (i = 0; i < syms_len; i++)
+  {
+    unsigned long long value = entries[i];
+    if (value == 0)
+      value = (cfg->bits == 64 ? 0x8000000000000000ULL : 0x80000000ULL) | (unsigned long long) ((first + i) % cfg->exports + 1);
+    if (ptr == 8)
+      Set64 (b, rva + i * 8, value);
+    else
+      Set32 (b, rva + i * 4, (unsigned long) value);
+  }
+  free (entries);
+  return rva;
+}
+
+static int WriteImage (const char *path, const PeGenConfig *cfg, const char *self_name, int is_dll,
+    int exports, const char *forward_to, char **deps, int deps_len, int delay, int deps_forwarders)
+{
+  ByteBuf rd;
+  unsigned long text_size = cfg->text > 0 ? 1024 * (unsigned long) cfg->text : FILE_ALIGNMENT;
+  unsigned long text_pages = (text_size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT;
+  unsigned long rdata_rva = (unsigned long) SECTION_ALIGNMENT * (text_pages + cfg->sections - 1);
+  unsigned long exp_rva = 0, exp_size = 0, imp_rva = 0, imp_size = 0, dly_rva = 0, dly_size = 0;
+  unsigned long opt_size = cfg->bits == 64 ? 240 : 224;
+  unsigned long headers, hdr_size, rd_raw, size_of_image, pos;
+  unsigned char *out;
+  size_t out_len;
+  int i, normal = deps_len - delay;
+  FILE *f;
+
+  memset (&rd, 0, sizeof (rd));
+  rd.base = rdata_rva;
+
+  if (exports > 0)
+  {
+    int forwarders = forward_to != NULL ? cfg->forwarders : 0;
+    int total = exports + forwarders;
+    unsigned long funcs, names, ords, name_rva;
+    Pad (&rd, 4);
+    exp_rva = PutZeros (&rd, 40);
+    funcs = PutZeros (&rd, 4 * (size_t) total);
+    names = PutZeros (&rd, 4 * (size_t) total);
+    ords = PutZeros (&rd, 2 * (size_t) total);
+    Pad (&rd, 4);
+    name_rva = PutString (&rd, self_name);
+    /* "Fn" sorts before "Fwd", so the name table stays sorted */
+    for (i = 0; i < total; i++)
+    {
+      char name[32];
+      if (i < exports)
+      {
+        sprintf (name, "Fn%05d", i);
+        Set32 (&rd, funcs + 4 * i, 0x1000 + 16 * (i % 32));
+      }
+      else
+      {
+        char forward[64];
+        sprintf (name, "Fwd%05d", i - exports);
+        sprintf (forward, "%.*s.Fn%05d", (int) (strlen (forward_to) - 4), forward_to, (i - exports) % exports);
+        Set32 (&rd, funcs + 4 * i, PutString (&rd, forward));
+      }
+      Set32 (&rd, names + 4 * i, PutString (&rd, name));
+      Set16 (&rd, ords + 2 * i, (unsigned) i);
+    }
+    exp_size = Here (&rd) - exp_rva;
+    Set32 (&rd, exp_rva + 12, name_rva);
+    Set32 (&rd, exp_rva + 16, 1);
+    Set32 (&rd, exp_rva + 20, (unsigned long) total);
+    Set32 (&rd, exp_rva + 24, (unsigned long) total);
+    Set32 (&rd, exp_rva + 28, funcs);
+    Set32 (&rd, exp_rva + 32, names);
+    Set32 (&rd, exp_rva + 36, ords);
+  }
+
+  if (normal > 0)
+  {
+    Pad (&rd, 4);
+    imp_size = 20 * (unsigned long) (normal + 1);
+    imp_rva = PutZeros (&rd, imp_size);
+    for (i = 0; i < normal; i++)
+    {
+      unsigned long desc = imp_rva + 20 * i;
+      Set32 (&rd, desc + 12, PutString (&rd, deps[i]));
+      Set32 (&rd, desc, PutThunks (&rd, cfg, i * 13, cfg->imports, deps_forwarders));
+      Set32 (&rd, desc + 16, PutThunks (&rd, cfg, i * 13, cfg->imports, deps_forwarders));
+    }
+  }
+
+  if (delay > 0)
+  {
+    Pad (&rd, 4);
+    dly_size = 32 * (unsigned long) (delay + 1);
+    dly_rva = PutZeros (&rd, dly_size);
+    for (i = 0; i < delay; i++)
+    {
+      unsigned long desc = dly_rva + 32 * i;
+      Set32 (&rd, desc, 1);
+      Set32 (&rd, desc + 4, PutString (&rd, deps[normal + i]));
+      Set32 (&rd, desc + 16, PutThunks (&rd, cfg, i * 7, cfg->imports, deps_forwarders));
+      Set32 (&rd, desc + 12, PutThunks (&rd, cfg, i * 7, cfg->imports, deps_forwarders));
+      Pad (&rd, 8);
+      Set32 (&rd, desc + 8, PutZeros (&rd, 8));
+    }
+  }
+  Pad (&rd, 16);
+
+  headers = 0x80 + 4 + 20 + opt_size + 40 * (unsigned long) cfg->sections;
+  hdr_size = (headers + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT;
+  rd_raw = (unsigned long) ((rd.len + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT);
+  size_of_image = (unsigned long) ((rdata_rva + rd.len + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT);
+
+  /* The headers are built in a ByteBuf too, based at 0 */
+  {
+    ByteBuf h;
+    memset (&h, 0, sizeof (h));
+    PutZeros (&h, hdr_size + text_size + rd_raw);
+    Set16 (&h, 0, 0x5a4d);
+    Set32 (&h, 0x3c, 0x80);
+    Set32 (&h, 0x80, 0x4550);
+    pos = 0x84;
+    Set16 (&h, pos, cfg->bits == 64 ? 0x8664 : 0x14c);
+    Set16 (&h, pos + 2, (unsigned) cfg->sections);
+    Set32 (&h, pos + 4, 0x12345678);
+    Set16 (&h, pos + 16, (unsigned) opt_size);
+    Set16 (&h, pos + 18, (is_dll ? 0x2000 : 0) | (cfg->bits == 64 ? 0x22 : 0x102));
+    pos += 20;
+    Set16 (&h, pos, cfg->bits == 64 ? 0x20b : 0x10b);
+    Set32 (&h, pos + 4, text_size);
+    Set32 (&h, pos + 20, 0x1000);
+    if (cfg->bits == 64)
+      Set64 (&h, pos + 24, 0x180000000ULL);
+    else
+      Set32 (&h, pos + 28, 0x10000000UL);
+    Set32 (&h, pos + 32, SECTION_ALIGNMENT);
+    Set32 (&h, pos + 36, FILE_ALIGNMENT);
+    Set16 (&h, pos + 40, 4);
+    Set16 (&h, pos + 48, 4);
+    Set32 (&h, pos + 56, size_of_image);
+    Set32 (&h, pos + 60, hdr_size);
+    Set16 (&h, pos + 68, 3);
+    pos += cfg->bits == 64 ? 108 : 92;
+    Set32 (&h, pos, 16);
+    pos += 4;
+    Set32 (&h, pos + 0 * 8, exp_rva);
+    Set32 (&h, pos + 0 * 8 + 4, exp_size);
+    Set32 (&h, pos + 1 * 8, imp_rva);
+    Set32 (&h, pos + 1 * 8 + 4, imp_size);
+    Set32 (&h, pos + 13 * 8, dly_rva);
+    Set32 (&h, pos + 13 * 8 + 4, dly_size);
+    pos += 16 * 8;
+
+    /* .text, the uninitialized sections, then .rdata */
+    for (i = 0; i < cfg->sections; i++)
+    {
+      unsigned long sec = pos + 40 * i;
+      if (i == 0)
+      {
+        memcpy (&h.data[sec], ".text", 5);
+        Set32 (&h, sec + 8, text_pages * SECTION_ALIGNMENT);
+        Set32 (&h, sec + 12, SECTION_ALIGNMENT);
+        Set32 (&h, sec + 16, text_size);
+        Set32 (&h, sec + 20, hdr_size);
+        Set32 (&h, sec + 36, 0x60000020);
+      }
+      else if (i < cfg->sections - 1)
+      {
+        char name[16];
+        sprintf (name, ".bss%d", i - 1);
+        memcpy (&h.data[sec], name, strlen (name));
+        Set32 (&h, sec + 8, 0x800);
+        Set32 (&h, sec + 12, SECTION_ALIGNMENT * (text_pages + (unsigned long) i));
+        Set32 (&h, sec + 36, 0xc0000080);
+      }
+      else
+      {
+        memcpy (&h.data[sec], ".rdata", 6);
+        Set32 (&h, sec + 8, (unsigned long) rd.len);
+        Set32 (&h, sec + 12, rdata_rva);
+        Set32 (&h, sec + 16, rd_raw);
+        Set32 (&h, sec + 20, hdr_size + text_size);
+        Set32 (&h, sec + 36, 0x40000040);
+      }
+    }
+    memset (&h.data[hdr_size], 0xcc, text_size);
+    memcpy (&h.data[hdr_size + text_size], rd.data, rd.len);
+    out = h.data;
+    out_len = h.len;
+  }
+  free (rd.data);
+
+  f = fopen (path, "wb");
+  if (f == NULL || fwrite (out, 1, out_len, f) != out_len)
+  {
+    fprintf (stderr, "pegen: could not write %s\n", path);
+    if (f != NULL)
+      fclose (f);
+    free (out);
+    return -1;
+  }
+  fclose (f);
+  free (out);
+  return 0;
+}
+
+/* Writes an API Set schema, version 6 as in Windows 10, that maps
+ * the contract of each module of the second level to that module
+ */
+static int WriteApiSetSchema (const char *path, const PeGenConfig *cfg)
+{
+  ByteBuf b;
+  unsigned long entries, values, len;
+  char contract[64], host[32];
+  int i, ok;
+  FILE *f;
+
+  memset (&b, 0, sizeof (b));
+  PutZeros (&b, 28);
+  entries = PutZeros (&b, 24 * (size_t) cfg->width);
+  values = PutZeros (&b, 20 * (size_t) cfg->width);
+  Set32 (&b, 0, 6);
+  Set32 (&b, 12, (unsigned long) cfg->width);
+  Set32 (&b, 16, entries);
+  for (i = 0; i < cfg->width; i++)
+  {
+    unsigned long e = entries + 24 * i, v = values + 20 * i;
+    ContractName (contract, i);
+    contract[strlen (contract) - 4] = '\0';
+    ModuleName (host, 1, i);
+    Set32 (&b, e + 4, PutUtf16 (&b, contract, &len));
+    Set32 (&b, e + 8, len);
+    Set32 (&b, e + 12, len - 4);
+    Set32 (&b, e + 16, v);
+    Set32 (&b, e + 20, 1);
+    Set32 (&b, v + 12, PutUtf16 (&b, host, &len));
+    Set32 (&b, v + 16, len);
+  }
+  Set32 (&b, 4, (unsigned long) b.len);
+
+  f = fopen (path, "wb");
+  ok = f != NULL && fwrite (b.data, 1, b.len, f) == b.len;
+  if (f != NULL && fclose (f) != 0)
+    ok = 0;
+  free (b.data);
+  if (!ok)
+  {
+    fprintf (stderr, "pegen: could not write %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+int GenerateCorpus (const char *dir, const PeGenConfig *cfg)
+{
+  char path[4096], name[32], next[64];
+  char **deps = (char **) malloc (sizeof (char *) * (cfg->width > cfg->fanout ? cfg->width : cfg->fanout));
+  int level, index, i, deps_len;
+
+  for (i = 0; i < (cfg->width > cfg->fanout ? cfg->width : cfg->fanout); i++)
+    deps[i] = (char *) malloc (32);
+  for (level = 0; level < cfg->depth; level++)
+  {
+    for (index = 0; index < cfg->width; index++)
+    {
+      int last = level == cfg->depth - 1;
+      ModuleName (name, level, index);
+      deps_len = last ? 0 : (cfg->fanout < cfg->width ? cfg->fanout : cfg->width);
+      for (i = 0; i < deps_len; i++)
+        ModuleName (deps[i], level + 1, (index * cfg->fanout + i) % cfg->width);
+      if (level == 0)
+        ContractName (next, index);
+      else
+        ModuleName (next, level + 1, index);
+      sprintf (path, "%s/%s", dir, name);
+      if (WriteImage (path, cfg, name, 1, cfg->exports, last ? NULL : next, deps, deps_len,
+          cfg->delay < deps_len ? cfg->delay : deps_len, level + 2 < cfg->depth ? cfg->forwarders : 0) != 0)
+        return -1;
+    }
+  }
+  for (i = 0; i < cfg->width; i++)
+    ModuleName (deps[i], 0, i);
+  sprintf (path, "%s/app.exe", dir);
+  if (WriteImage (path, cfg, "app.exe", 0, 0, NULL, deps, cfg->depth > 0 ? cfg->width : 0, 0,
+      cfg->depth > 1 ? cfg->forwarders : 0) != 0)
+    return -1;
+  sprintf (path, "%s/apiset.bin", dir);
+  if (WriteApiSetSchema (path, cfg) != 0)
+    return -1;
+  for (i = 0; i < (cfg->width > cfg->fanout ? cfg->width : cfg->fanout); i++)
+    free (deps[i]);
+  free (deps);
+  return 0;
+}
+
+void printhelp (char *argv0)
+{
+  printf ("Usage: %s [OPTION]... DIR\n\
+Writes app.exe, its dependencies and the API Set schema apiset.bin\n\
+into the existing directory DIR\n\
+OPTIONS:\n\
+-b BITS        32 for PE32 images (default), 64 for PE32+\n\
+-w WIDTH       Modules per level (default 20)\n\
+-d DEPTH       Levels of modules below app.exe (default 5)\n\
+-f FANOUT      Modules of the next level each module imports (default 4)\n\
+-e EXPORTS     Exports per module (default 500)\n\
+-i IMPORTS     Functions imported from each module (default 50)\n\
+-D DELAY       Of those modules, how many are delay-loaded (default 1)\n\
+-F FORWARDERS  Exports forwarded to the next level (default 10)\n\
+-s SECTIONS    Sections per image, 2 to 96 (default 3)\n\
+-t KIB         Size of the .text section, which nothing reads, in KiB,\n\
+               up to 65536 (default 64; 0 for a single 512-byte block)\n", argv0);
+}
+
+int main (int argc, char **argv)
+{
+  PeGenConfig cfg;
+  int i;
+
+  cfg.bits = 32;
+  cfg.width = 20;
+  cfg.depth = 5;
+  cfg.fanout = 4;
+  cfg.exports = 500;
+  cfg.imports = 50;
+  cfg.delay = 1;
+  cfg.forwarders = 10;
+  cfg.sections = 3;
+  cfg.text = 64;
+  for (i = 1; i < argc - 1 && argv[i][0] == '-' && strlen (argv[i]) == 2; i += 2)
+  {
+    int v = atoi (argv[i + 1]);
+    switch (argv[i][1])
+    {
+    case 'b': cfg.bits = v; break;
+    case 'w': cfg.width = v; break;
+    case 'd': cfg.depth = v; break;
+    case 'f': cfg.fanout = v; break;
+    case 'e': cfg.exports = v; break;
+    case 'i': cfg.imports = v; break;
+    case 'D': cfg.delay = v; break;
+    case 'F': cfg.forwarders = v; break;
+    case 's': cfg.sections = v; break;
+    case 't': cfg.text = v; break;
+    default:
+      printhelp (argv[0]);
+      return 1;
+    }
+  }
+  if (i != argc - 1 || (cfg.bits != 32 && cfg.bits != 64) || cfg.width < 1 || cfg.depth < 0 ||
+      cfg.fanout < 0 || cfg.exports < 1 || cfg.exports > 65535 || cfg.imports < 0 || cfg.delay < 0 ||
+      cfg.forwarders < 0 || cfg.sections < 2 || cfg.sections > 96 || cfg.text < 0 || cfg.text > 65536)
+  {
+    printhelp (argv[0]);
+    return 1;
+  }
+  return GenerateCorpus (argv[i], &cfg) != 0;
+}
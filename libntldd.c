@@ -23,18 +23,168 @@ Code is mostly written after
 MSDN Magazine articles
 */
 
+#ifdef _WIN32
 #include <windows.h>
 
 #include <imagehlp.h>
 
 #include <winnt.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
+#endif
 
 #include "libntldd.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+/* Thunk arrays are scanned 16 or 32 bytes at a time where the
+ * compiler targets SSE2 or AVX2, and one entry at a time elsewhere
+ */
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define THUNK_SCAN_AVX2
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define THUNK_SCAN_SSE2
+#endif
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION NtlddMutex;
+#define MutexInit(m) InitializeCriticalSection (m)
+#define MutexDestroy(m) DeleteCriticalSection (m)
+#define MutexLock(m) EnterCriticalSection (m)
+#define MutexUnlock(m) LeaveCriticalSection (m)
+#define YieldThread() Sleep (0)
+#else
+typedef pthread_mutex_t NtlddMutex;
+#define MutexInit(m) pthread_mutex_init (m, NULL)
+#define MutexDestroy(m) pthread_mutex_destroy (m)
+#define MutexLock(m) pthread_mutex_lock (m)
+#define MutexUnlock(m) pthread_mutex_unlock (m)
+#define YieldThread() sched_yield ()
+#endif
+
+struct BuildStats
+{
+  NtlddMutex lock;
+  uint64_t time[STATS_PHASES];
+  uint64_t calls[STATS_PHASES];
+  /* Longest first */
+  char *slowest[STATS_SLOWEST];
+  uint64_t slowest_time[STATS_SLOWEST];
+  int slowest_len;
+};
+
+struct BuildStats *NewBuildStats (void)
+{
+  struct BuildStats *stats = (struct BuildStats *) calloc (1, sizeof (struct BuildStats));
+  if (stats == NULL)
+    return NULL;
+  MutexInit (&stats->lock);
+  return stats;
+}
+
+void FreeBuildStats (struct BuildStats *stats)
+{
+  int i;
+  if (stats == NULL)
+    return;
+  for (i = 0; i < stats->slowest_len; i++)
+    free (stats->slowest[i]);
+  MutexDestroy (&stats->lock);
+  free (stats);
+}
+
+void GetPhaseStats (struct BuildStats *stats, int phase, uint64_t *time, uint64_t *calls)
+{
+  *time = stats->time[phase];
+  *calls = stats->calls[phase];
+}
+
+int GetSlowestModule (struct BuildStats *stats, int i, const char **name, uint64_t *time)
+{
+  if (i < 0 || i >= stats->slowest_len)
+    return 0;
+  *name = stats->slowest[i];
+  *time = stats->slowest_time[i];
+  return 1;
+}
+
+#ifndef NTLDD_NO_STATS
+static uint64_t StatsNow (void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter (&now);
+  QueryPerformanceFrequency (&freq);
+  return (uint64_t) (now.QuadPart / freq.QuadPart * 1000000000 +
+      now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void StatsAdd (struct BuildStats *stats, int phase, uint64_t time, uint64_t calls)
+{
+  MutexLock (&stats->lock);
+  stats->time[phase] += time;
+  stats->calls[phase] += calls;
+  MutexUnlock (&stats->lock);
+}
+
+static void StatsModule (struct BuildStats *stats, const char *name, uint64_t time)
+{
+  int i;
+  char *copy;
+  MutexLock (&stats->lock);
+  if (stats->slowest_len < STATS_SLOWEST || time > stats->slowest_time[STATS_SLOWEST - 1])
+  {
+    /* Out of memory, the module is left out of the list */
+    copy = strdup (name);
+    if (copy == NULL)
+    {
+      MutexUnlock (&stats->lock);
+      return;
+    }
+    if (stats->slowest_len == STATS_SLOWEST)
+      free (stats->slowest[--stats->slowest_len]);
+    for (i = stats->slowest_len; i > 0 && stats->slowest_time[i - 1] < time; i--)
+    {
+      stats->slowest[i] = stats->slowest[i - 1];
+      stats->slowest_time[i] = stats->slowest_time[i - 1];
+    }
+    stats->slowest[i] = copy;
+    stats->slowest_time[i] = time;
+    stats->slowest_len++;
+  }
+  MutexUnlock (&stats->lock);
+}
 
-extern FILE *fp; // in ntldd.c
+/* t holds the start time of a phase, or 0 if cfg gathers no stats */
+#define STATS_START(cfg, t) ((t) = (cfg)->stats != NULL ? StatsNow () : 0)
+#define STATS_END_N(cfg, phase, t, n) \
+  do { if ((cfg)->stats != NULL) StatsAdd ((cfg)->stats, (phase), StatsNow () - (t), (n)); } while (0)
+#define STATS_MODULE(cfg, name, t) \
+  do { if ((cfg)->stats != NULL) StatsModule ((cfg)->stats, (name), StatsNow () - (t)); } while (0)
+#else
+#define STATS_START(cfg, t) ((void) (t))
+#define STATS_END_N(cfg, phase, t, n) ((void) (t))
+#define STATS_MODULE(cfg, name, t) ((void) (t))
+#endif
+#define STATS_END(cfg, phase, t) STATS_END_N (cfg, phase, t, 1)
 
 /* imagehlp functions from ReactOS */
 PIMAGE_NT_HEADERS RosRtlImageNtHeader(void *data)
@@ -51,6 +201,7 @@ PIMAGE_NT_HEADERS RosRtlImageNtHeader(void *data)
     return NtHeaders;
 }
 
+#ifdef _WIN32
 BOOL WINAPI MyMapAndLoad(PCSTR pszImageName, PCSTR pszDllPath, PLOADED_IMAGE pLoadedImage,
                        BOOL bDotDll, BOOL bReadOnly)
 {
@@ -172,557 +323,4305 @@ BOOL WINAPI RosUnMapAndLoad(PLOADED_IMAGE pLoadedImage)
     if (pLoadedImage->hFile != INVALID_HANDLE_VALUE) CloseHandle(pLoadedImage->hFile);
     return TRUE;
 }
+#endif
 /* end of imagehlp functions from ReactOS */
 
-typedef struct _soff_entry soff_entry;
+/* Returns the NT headers of the image at data if they, and the section
+ * table after them, fit in size bytes
+ */
+static PIMAGE_NT_HEADERS CheckImageHeaders (void *data, uint64_t size)
+{
+  PIMAGE_DOS_HEADER dos = (PIMAGE_DOS_HEADER) data;
+  PIMAGE_NT_HEADERS nt;
+  if (size < sizeof (IMAGE_DOS_HEADER) || dos->e_magic != IMAGE_DOS_SIGNATURE || dos->e_lfanew < 0 ||
+      (uint64_t) dos->e_lfanew + sizeof (IMAGE_NT_HEADERS) > size)
+    return NULL;
+  nt = RosRtlImageNtHeader (data);
+  if (nt == NULL || (uint64_t) dos->e_lfanew + sizeof (DWORD) + sizeof (IMAGE_FILE_HEADER) +
+      nt->FileHeader.SizeOfOptionalHeader + nt->FileHeader.NumberOfSections * sizeof (IMAGE_SECTION_HEADER) > size)
+    return NULL;
+  return nt;
+}
 
-struct _soff_entry
+static void FillLoadedImage (PLOADED_IMAGE img, char *module_name, HANDLE file, void *mapping, PIMAGE_NT_HEADERS nt, uint64_t size)
 {
-  DWORD start;
-  DWORD end;
-  char *off;
-};
+  img->ModuleName       = module_name;
+  img->hFile            = file;
+  img->MappedAddress    = (PUCHAR) mapping;
+  img->FileHeader       = nt;
+  img->Sections         = (PIMAGE_SECTION_HEADER)
+      ((LPBYTE) &nt->OptionalHeader + nt->FileHeader.SizeOfOptionalHeader);
+  img->NumberOfSections = nt->FileHeader.NumberOfSections;
+  img->SizeOfImage      = (ULONG) size;
+  img->Characteristics  = nt->FileHeader.Characteristics;
+  img->LastRvaSection   = img->Sections;
+  img->fSystemImage     = FALSE;
+  img->fDOSImage        = FALSE;
+  img->Links.Flink      = &img->Links;
+  img->Links.Blink      = &img->Links;
+}
 
-void *MapPointer (soff_entry *soffs, int soffs_len, DWORD in_ptr, int *section)
+#ifdef _WIN32
+static BOOL Win32MapAndLoad (ImageLoader *loader, PCSTR name, PCSTR path, PLOADED_IMAGE img, BOOL bDotDll)
 {
-  int i;
-  for (i = 0; i < soffs_len; i++)
-    if (soffs[i].start <= in_ptr && soffs[i].end >= in_ptr)
-    {
-      if (section != NULL)
-        *section = i;
-      if (soffs[i].off)
-        return soffs[i].off + in_ptr;
-    }
-  return NULL;
+  if (!MyMapAndLoad (name, path, img, bDotDll, TRUE))
+    return FALSE;
+  loader->images_loaded += 1;
+  loader->bytes_mapped += img->SizeOfImage;
+  return TRUE;
 }
 
-/*
-int FindSectionID (IMAGE_OPTIONAL_HEADER *oh, DWORD address, DWORD size)
+static BOOL Win32UnMapAndLoad (ImageLoader *loader, PLOADED_IMAGE img)
 {
-  int i;
-  for (i = 0; i < oh->NumberOfRvaAndSizes; i++)
-  {
-    if (oh->DataDirectory[i].VirtualAddress == address &&
-        oh->DataDirectory[i].Size == size)
-      return i;
-  }
-  return -1;
+  (void) loader;
+  return RosUnMapAndLoad (img);
 }
-*/
 
-int FindSectionByRawData (LOADED_IMAGE *img, DWORD address)
+/* Like MyMapAndLoad, without the Win32s fallbacks. found is set to the
+ * path found by SearchPathA, or to an empty string.
+ */
+static HANDLE OpenImageFile (PCSTR name, PCSTR path, BOOL bDotDll, char found[MAX_PATH], uint64_t *size)
 {
-  ULONG i;
-  for (i = 0; i < img->NumberOfSections; i++)
+  LPSTR file_part;
+  DWORD len, high = 0;
+  HANDLE h;
+
+  found[0] = '\0';
+  h = CreateFileA (name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+  if (h == INVALID_HANDLE_VALUE)
   {
-    DWORD start = img->Sections[i].VirtualAddress;
-    DWORD end = start + img->Sections[i].SizeOfRawData;
-    if (address >= start && address < end)
-      return i;
+    len = SearchPathA (path, name, bDotDll ? ".DLL" : ".EXE", MAX_PATH, found, &file_part);
+    if (len > 0 && len < MAX_PATH)
+      h = CreateFileA (found, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+      found[0] = '\0';
+      SetLastError (ERROR_FILE_NOT_FOUND);
+      return INVALID_HANDLE_VALUE;
+    }
   }
-  return -1;
+  *size = GetFileSize (h, &high);
+  *size |= (uint64_t) high << 32;
+  return h;
 }
 
-void ResizeArray (void **data, uint64_t *data_size, size_t sizeof_data)
+static BOOL ReadImageFile (HANDLE h, void *buf, DWORD offset, DWORD size, DWORD *got)
 {
-#ifdef _MIPS_
-  size_t new_size;
-#else
-  uint64_t new_size;
-#endif
-  void *new_data;
-  new_size = (*data_size) > 0 ? (*data_size) * 2 : 64;
-  new_data = (unsigned char *) realloc (*data, new_size * sizeof_data);
-  memset (((unsigned char *) new_data) + (*data_size * sizeof_data), 0, (size_t)((new_size - (*data_size)) * sizeof_data));
-  *data = new_data;
-  *data_size = new_size;
+  *got = 0;
+  if (SetFilePointer (h, (LONG) offset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER && GetLastError () != NO_ERROR)
+    return FALSE;
+  return ReadFile (h, buf, size, got, NULL);
+}
+
+static void CloseImageFile (HANDLE h)
+{
+  CloseHandle (h);
 }
 
-#define ResizeDepList(ptr_deptree, ptr_deptree_size) ResizeArray ((void **) ptr_deptree, ptr_deptree_size, sizeof (struct DepTreeElement *))
-#define ResizeImportList(ptr_import_list, ptr_import_list_size) ResizeArray ((void **) ptr_import_list, ptr_import_list_size, sizeof (struct ImportTableItem))
-#define ResizeStack(ptr_stack, ptr_stack_size) ResizeArray ((void **) ptr_stack, ptr_stack_size, sizeof (char *))
+static uint64_t ImageFileMTime (HANDLE h)
+{
+  FILETIME ft;
+  if (!GetFileTime (h, NULL, NULL, &ft))
+    return 0;
+  return ((uint64_t) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
 
-void AddDep (struct DepTreeElement *parent, struct DepTreeElement *child)
+static void FullImagePath (PCSTR path, char full[MAX_PATH])
 {
-  if (parent->childs_len >= parent->childs_size)
-  {
-    ResizeDepList (&parent->childs, &parent->childs_size);
-  }
-  parent->childs[parent->childs_len] = child;
-  parent->childs_len += 1;
+  DWORD len = GetFullPathNameA (path, MAX_PATH, full, NULL);
+  if (len == 0 || len >= MAX_PATH)
+    strcpy (full, path);
 }
 
-struct ImportTableItem *AddImport (struct DepTreeElement *self)
+static BOOL RenameOver (PCSTR from, PCSTR to)
 {
-  if (self->imports_len >= self->imports_size)
-  {
-    ResizeImportList (&self->imports, &self->imports_size);
-  }
-  self->imports_len += 1;
-  return &self->imports[self->imports_len - 1];
+  return MoveFileExA (from, to, MOVEFILE_REPLACE_EXISTING);
 }
 
-int FindDep (struct DepTreeElement *root, char *name, int machineType, struct DepTreeElement **result)
+/* Creates a file next to path that no other process writes to, and
+ * puts its name in tmp, which holds strlen (path) + 32 bytes
+ */
+static FILE *CreateTempFile (PCSTR path, char *tmp)
 {
-  int ret = -1;
-  uint64_t i;
-  if (root->flags & DEPTREE_VISITED)
+  sprintf (tmp, "%s.%lu.%lu.tmp", path, (unsigned long) GetCurrentProcessId (), (unsigned long) GetTickCount ());
+  return fopen (tmp, "wb");
+}
+
+/* Pages that are never read into stay untouched and cost nothing */
+static void *AllocImageBuffer (uint64_t size)
+{
+  return VirtualAlloc (NULL, (SIZE_T) size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+static void FreeImageBuffer (void *buf, uint64_t size)
+{
+  (void) size;
+  VirtualFree (buf, 0, MEM_RELEASE);
+}
+#else
+/* Looks up name in dir (or relative to the current directory if dir
+ * is NULL), appending ext if name has no extension. The last path
+ * component is matched case-insensitively, like Windows would.
+ */
+static BOOL PosixFindFile (PCSTR dir, PCSTR name, PCSTR ext, char found[MAX_PATH])
+{
+  char full[MAX_PATH], dirpart[MAX_PATH];
+  char *base, *best = NULL;
+  struct stat st;
+  DIR *d;
+  struct dirent *de;
+
+  if (dir != NULL && name[0] != '/')
+    snprintf (full, MAX_PATH, "%s%s%s", dir, dir[0] && dir[strlen (dir) - 1] == '/' ? "" : "/", name);
+  else
+    snprintf (full, MAX_PATH, "%s", name);
+  base = strrchr (full, '/');
+  base = base != NULL ? base + 1 : full;
+  if (ext != NULL && strchr (base, '.') == NULL && strlen (full) + strlen (ext) < MAX_PATH)
+    strcat (full, ext);
+  if (stat (full, &st) == 0 && S_ISREG (st.st_mode))
   {
-    return -2;
+    strcpy (found, full);
+    return TRUE;
   }
-  root->flags |= DEPTREE_VISITED;
-  for (i = 0; i < root->childs_len; i++)
+
+  if (base == full)
+    strcpy (dirpart, ".");
+  else
   {
-    if (stricmp (root->childs[i]->module, name) == 0 && root->childs[i]->machineType == machineType)
-    {
-      if (result != NULL)
-        *result = root->childs[i];
-      root->flags &= ~DEPTREE_VISITED;
-      return (root->childs[i]->flags & DEPTREE_UNRESOLVED) ? 1 : 0;
-    }
+    memcpy (dirpart, full, base - full);
+    dirpart[base - full == 1 ? 1 : base - full - 1] = '\0';
   }
-  for (i = 0; i < root->childs_len && ret < 0; i++)
+  d = opendir (dirpart);
+  if (d == NULL)
+    return FALSE;
+  /* Pick the lowest-sorting match so that the result does not depend
+   * on directory order when several names differ only in case
+   */
+  while ((de = readdir (d)) != NULL)
   {
-    ret = FindDep (root->childs[i], name, machineType, result);
+    if (strcasecmp (de->d_name, base) != 0 || (best != NULL && strcmp (de->d_name, best) >= 0))
+      continue;
+    if (snprintf (found, MAX_PATH, "%s/%s", dirpart, de->d_name) >= MAX_PATH)
+      continue;
+    if (stat (found, &st) != 0 || !S_ISREG (st.st_mode))
+      continue;
+    free (best);
+    best = strdup (de->d_name);
   }
-  root->flags &= ~DEPTREE_VISITED;
-  return ret;
+  closedir (d);
+  if (best == NULL)
+    return FALSE;
+  /* The loop only keeps names that fit */
+  if (base == full)
+    strcpy (found, best);
+  else if (snprintf (found, MAX_PATH, "%s/%s", dirpart, best) >= MAX_PATH)
+    found[0] = '\0';
+  free (best);
+  return found[0] != '\0';
 }
 
-int BuildDepTree (BuildTreeConfig* cfg, char *name, struct DepTreeElement *root, struct DepTreeElement *self);
-
-struct DepTreeElement *ProcessDep (BuildTreeConfig* cfg, soff_entry *soffs, int soffs_len, DWORD name, struct DepTreeElement *root, struct DepTreeElement *self, int deep)
+static HANDLE OpenImageFile (PCSTR name, PCSTR path, BOOL bDotDll, char found[MAX_PATH], uint64_t *size)
 {
-  struct DepTreeElement *child = NULL;
-  int found;
-  int64_t i;
-  char *dllname = (char *) MapPointer (soffs, soffs_len, name, NULL);
-  if (dllname == NULL)
-    return NULL;
-#if 0
-  if (strlen (dllname) > 10 && strnicmp ("api-ms-win", dllname, 10) == 0)
-  {
-    /* TODO: find a better way to identify api stubs. Versioninfo, maybe? */
-    return NULL;
-  }
-#endif
-  for (i = (int64_t)*cfg->stack_len - 1; i >= 0; i--)
-  {
-    if ((*cfg->stack)[i] && stricmp ((*cfg->stack)[i], dllname) == 0)
-      return NULL;
-    if (i == 0)
-      break;
-  }
-  found = FindDep (root, dllname, self->machineType, &child);
-  if (found < 0)
+  char module[MAX_PATH];
+  struct stat st;
+  int fd;
+
+  /* Same order as MyMapAndLoad: the name as given, then the search */
+  found[0] = '\0';
+  if (!PosixFindFile (NULL, name, NULL, module))
   {
-    child = (struct DepTreeElement *) malloc (sizeof (struct DepTreeElement));
-    memset (child, 0, sizeof (struct DepTreeElement));
-    if (deep == 0)
+    if (!PosixFindFile (path != NULL ? path : ".", name, bDotDll ? ".DLL" : ".EXE", found))
     {
-      child->module = strdup (dllname);
-      child->machineType = self->machineType;
-      AddDep (self, child);
+      found[0] = '\0';
+      SetLastError (ERROR_FILE_NOT_FOUND);
+      return INVALID_HANDLE_VALUE;
     }
+    strcpy (module, found);
   }
-  if (deep == 1)
+  fd = open (module, O_RDONLY);
+  if (fd < 0)
+    return INVALID_HANDLE_VALUE;
+  if (fstat (fd, &st) != 0)
   {
-    BuildDepTree (cfg, dllname, root, child);
+    close (fd);
+    return INVALID_HANDLE_VALUE;
   }
-  return child;
+  *size = (uint64_t) st.st_size;
+  return (HANDLE) (intptr_t) fd;
 }
 
+/* pread () may return less than asked for before the end of the file,
+ * so this reads on until it has all of it or the file ends
+ */
+static BOOL ReadImageFile (HANDLE h, void *buf, DWORD offset, DWORD size, DWORD *got)
+{
+  ssize_t n;
+  *got = 0;
+  while (*got < size)
+  {
+    n = pread ((int) (intptr_t) h, (char *) buf + *got, size - *got, (off_t) offset + *got);
+    if (n < 0)
+      return FALSE;
+    if (n == 0)
+      break;
+    *got += (DWORD) n;
+  }
+  return TRUE;
+}
 
-/*
-struct ExportTableItem *FindExportForward (struct DepTreeElement *self, char *dllname, char *export_name, DWORD export_ordinal)
+static void CloseImageFile (HANDLE h)
 {
-  return NULL;
+  close ((int) (intptr_t) h);
 }
-*/
 
-int ClearDepStatus (struct DepTreeElement *self, uint64_t flags)
+/* In nanoseconds, since rebuilds within a second are common and
+ * most toolchains other than MSVC leave TimeDateStamp and CheckSum 0
+ */
+static uint64_t ImageFileMTime (HANDLE h)
 {
-  uint64_t i;
-  for (i = 0; i < self->childs_len; i++)
-    ClearDepStatus (self->childs[i], flags);
-  self->flags &= ~flags;
-  return 0;
+  struct stat st;
+  if (fstat ((int) (intptr_t) h, &st) != 0)
+    return 0;
+#ifdef __APPLE__
+  return (uint64_t) st.st_mtimespec.tv_sec * 1000000000 + (uint64_t) st.st_mtimespec.tv_nsec;
+#else
+  return (uint64_t) st.st_mtim.tv_sec * 1000000000 + (uint64_t) st.st_mtim.tv_nsec;
+#endif
 }
 
-void PushStack (char ***stack, uint64_t *stack_len, uint64_t *stack_size, char *name)
+static void FullImagePath (PCSTR path, char full[MAX_PATH])
 {
-  if (*stack_len >= *stack_size)
+  char resolved[PATH_MAX];
+  /* realpath () fails for names that were only found by ignoring case */
+  if (realpath (path, resolved) != NULL && strlen (resolved) < MAX_PATH)
+    strcpy (full, resolved);
+  else if (path[0] != '/' && getcwd (resolved, sizeof (resolved)) != NULL &&
+      strlen (resolved) + strlen (path) + 1 < MAX_PATH)
   {
-    ResizeStack (stack, stack_size);
+    strcpy (full, resolved);
+    strcat (full, "/");
+    strcat (full, path);
   }
-  (*stack)[*stack_len] = strdup (name);
-  (*stack_len) += 1;
+  else
+    strcpy (full, path);
 }
 
-void PopStack (char ***stack, uint64_t *stack_len, uint64_t *stack_size, char *name)
+static BOOL RenameOver (PCSTR from, PCSTR to)
 {
-  (*stack)[*stack_len] = NULL;
-  (*stack_len) -= 1;
+  return rename (from, to) == 0;
 }
 
-static uint64_t thunk_data_u1_function (void *thunk_array, DWORD index, struct DepTreeElement *node)
+/* Creates a file next to path that no other process writes to, and
+ * puts its name in tmp, which holds strlen (path) + 32 bytes
+ */
+static FILE *CreateTempFile (PCSTR path, char *tmp)
 {
-  if (!node->isPE32plus)
-    return (uint64_t)((IMAGE_THUNK_DATA32 *) thunk_array)[index].u1.Function;
-  else
-    return (uint64_t)((IMAGE_THUNK_DATA64 *) thunk_array)[index].u1.Function;
+  FILE *f;
+  mode_t mask;
+  int fd;
+  sprintf (tmp, "%s.XXXXXX", path);
+  fd = mkstemp (tmp);
+  if (fd < 0)
+    return NULL;
+  /* mkstemp () makes the file private; give it the mode fopen () would */
+  mask = umask (0);
+  umask (mask);
+  fchmod (fd, 0666 & ~mask);
+  f = fdopen (fd, "wb");
+  if (f == NULL)
+  {
+    close (fd);
+    remove (tmp);
+  }
+  return f;
 }
 
-static void *opt_header_get_dd_entry (void *opt_header, DWORD entry_type, struct DepTreeElement *node)
+/* Pages that are never read into stay untouched and cost nothing */
+static void *AllocImageBuffer (uint64_t size)
 {
-  if (!node->isPE32plus)
-    return &(((PIMAGE_OPTIONAL_HEADER32) opt_header)->DataDirectory[entry_type]);
-  else
-    return &(((PIMAGE_OPTIONAL_HEADER64) opt_header)->DataDirectory[entry_type]);
+  void *buf = mmap (NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return buf == MAP_FAILED ? NULL : buf;
 }
 
-static void BuildDepTree32or64 (LOADED_IMAGE *img, BuildTreeConfig* cfg, struct DepTreeElement *root, struct DepTreeElement *self, soff_entry *soffs, int soffs_len)
+static void FreeImageBuffer (void *buf, uint64_t size)
 {
-  IMAGE_DATA_DIRECTORY *idata;
-  IMAGE_IMPORT_DESCRIPTOR *iid;
-  IMAGE_EXPORT_DIRECTORY *ied;
-  IMAGE_DELAYLOAD_DESCRIPTOR *idd;
-  void *ith, *oith;
-  void *opt_header = &img->FileHeader->OptionalHeader;
-  DWORD i, j;
+  munmap (buf, (size_t) size);
+}
 
-  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_EXPORT, self);
-  if (idata->Size > 0 && idata->VirtualAddress != 0)
+static BOOL PosixMapAndLoad (ImageLoader *loader, PCSTR name, PCSTR path, PLOADED_IMAGE img, BOOL bDotDll)
+{
+  char found[MAX_PATH];
+  uint64_t size;
+  void *mapping;
+  PIMAGE_NT_HEADERS nt;
+  HANDLE h = OpenImageFile (name, path, bDotDll, found, &size);
+
+  if (h == INVALID_HANDLE_VALUE)
+    return FALSE;
+  if (size < sizeof (IMAGE_DOS_HEADER) || size > 0xFFFFFFFFU)
   {
-    int export_section = -2;
-    ied = (IMAGE_EXPORT_DIRECTORY *) MapPointer (soffs, soffs_len, idata->VirtualAddress, &export_section);
-    if (ied && ied->Name != 0)
-    {
-      char *export_module = MapPointer (soffs, soffs_len, ied->Name, NULL);
-      if (export_module != NULL)
-      {
-        if (self->export_module == NULL)
-          self->export_module = strdup (export_module);
-      }
-    }
-    if (ied && ied->NumberOfFunctions > 0)
-    {
-      DWORD *addrs, *names;
-      WORD *ords;
-      int section = -1;
-      self->exports_len = ied->NumberOfFunctions;
-      self->exports = (struct ExportTableItem *) malloc (sizeof (struct ExportTableItem) * self->exports_len);
-      memset (self->exports, 0, (size_t)(sizeof (struct ExportTableItem) * self->exports_len));
-      addrs = (DWORD *) MapPointer (soffs, soffs_len, (DWORD)ied->AddressOfFunctions, NULL);
-      ords = (WORD *) MapPointer (soffs, soffs_len, (DWORD)ied->AddressOfNameOrdinals, NULL);
-      names = (DWORD *) MapPointer (soffs, soffs_len, (DWORD)ied->AddressOfNames, NULL);
-      for (i = 0; ords && i < ied->NumberOfNames; i++)
-      {
-        self->exports[ords[i]].ordinal = ords[i] + ied->Base;
-        if (names[i] != 0)
-        {
-          char *s_name = (char *) MapPointer (soffs, soffs_len, names[i], NULL);
-          if (s_name != NULL)
-            self->exports[ords[i]].name = strdup (s_name);
-        }
-      }
-      for (i = 0; addrs && i < ied->NumberOfFunctions; i++)
-      {
-        if (addrs[i] != 0)
-        {
-          int section_index = FindSectionByRawData (img, addrs[i]);
-          if ((idata->VirtualAddress <= addrs[i]) && (idata->VirtualAddress + idata->Size > addrs[i]))
-          {
-            self->exports[i].address = NULL;
-            self->exports[i].forward_str = strdup ((char *) MapPointer (soffs, soffs_len, addrs[i], NULL));
-          }
-          else
-            self->exports[i].address = MapPointer (soffs, soffs_len, addrs[i], &section);
-          self->exports[i].ordinal = i + ied->Base;
-          self->exports[i].section_index = section_index;
-          self->exports[i].address_offset = addrs[i];
-        }
-      }
-    }
+    CloseImageFile (h);
+    SetLastError (ENOEXEC);
+    return FALSE;
   }
+  mapping = mmap (NULL, (size_t) size, PROT_READ, MAP_PRIVATE, (int) (intptr_t) h, 0);
+  CloseImageFile (h);
+  if (mapping == MAP_FAILED)
+    return FALSE;
+#ifdef POSIX_MADV_RANDOM
+  /* Only the headers and a few directories are ever looked at */
+  posix_madvise (mapping, (size_t) size, POSIX_MADV_RANDOM);
+#endif
 
-  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_IMPORT, self);
-  if (idata->Size > 0 && idata->VirtualAddress != 0)
+  nt = CheckImageHeaders (mapping, size);
+  if (nt == NULL)
   {
-    iid = (IMAGE_IMPORT_DESCRIPTOR *) MapPointer (soffs, soffs_len,
-        idata->VirtualAddress, NULL);
-    if (iid)
-      for (i = 0; iid[i].Characteristics || iid[i].TimeDateStamp ||
-          iid[i].ForwarderChain || iid[i].Name || iid[i].FirstThunk; i++)
-      {
-        struct DepTreeElement *dll;
-        uint64_t impaddress;
-        dll = ProcessDep (cfg, soffs, soffs_len, iid[i].Name, root, self, 0);
-        if (dll == NULL)
-          continue;
-        ith = (void *) MapPointer (soffs, soffs_len, (DWORD)iid[i].FirstThunk, NULL);
-        oith = (void *) MapPointer (soffs, soffs_len, (DWORD)iid[i].OriginalFirstThunk, NULL);
-        for (j = 0; (impaddress = thunk_data_u1_function (ith, j, self)) != 0; j++)
-        {
-          struct ImportTableItem *imp = AddImport (self);
-          if(!imp) continue;
-          imp->dll = dll;
-          imp->ordinal = -1;
-          imp->is_delayed = 0;
-          if (oith)
-            imp->orig_address = thunk_data_u1_function (oith, j, self);
-          else
-            imp->orig_address = thunk_data_u1_function (ith, j, self);
-          if (cfg->on_self)
-          {
-            imp->address = impaddress;
-          }
-          if (oith && imp->orig_address & (1 << (sizeof (DWORD) * 8 - 1)))
-          {
-            imp->ordinal = imp->orig_address & ~(1 << (sizeof (DWORD) * 8 - 1));
-          }
-          else if (oith||ith)
-          {
-            IMAGE_IMPORT_BY_NAME *byname = (IMAGE_IMPORT_BY_NAME *) MapPointer (soffs, soffs_len, (DWORD)imp->orig_address, NULL);
-            if (byname != NULL)
-              imp->name = strdup ((char *) byname->Name);
-          }
-        }
-      }
+    munmap (mapping, (size_t) size);
+    SetLastError (ENOEXEC);
+    return FALSE;
   }
+  FillLoadedImage (img, strdup (found), INVALID_HANDLE_VALUE, mapping, nt, size);
+  loader->images_loaded += 1;
+  loader->bytes_mapped += size;
+  return TRUE;
+}
 
-  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT, self);
-  if (idata->Size > 0 && idata->VirtualAddress != 0)
+static BOOL PosixUnMapAndLoad (ImageLoader *loader, PLOADED_IMAGE img)
+{
+  (void) loader;
+  free (img->ModuleName);
+  if (img->MappedAddress)
+    munmap (img->MappedAddress, img->SizeOfImage);
+  return TRUE;
+}
+#endif
+
+static BOOL PartialReadRange (ImageLoader *loader, HANDLE h, unsigned char *buf, uint64_t size, DWORD offset, DWORD len)
+{
+  DWORD got;
+  if (offset >= size)
+    return TRUE;
+  if ((uint64_t) offset + len > size)
+    len = (DWORD) (size - offset);
+  if (!ReadImageFile (h, buf + offset, offset, len, &got))
+    return FALSE;
+  loader->bytes_read += got;
+  return TRUE;
+}
+
+/* Reads the headers and section table into a buffer laid out like the
+ * file; sections are read later, through load_range (), when the
+ * parser first touches them.
+ */
+static BOOL PartialMapAndLoad (ImageLoader *loader, PCSTR name, PCSTR path, PLOADED_IMAGE img, BOOL bDotDll)
+{
+  char found[MAX_PATH];
+  uint64_t size, have;
+  unsigned char *buf;
+  PIMAGE_DOS_HEADER dos;
+  PIMAGE_NT_HEADERS nt = NULL;
+  HANDLE h = OpenImageFile (name, path, bDotDll, found, &size);
+
+  if (h == INVALID_HANDLE_VALUE)
+    return FALSE;
+  buf = NULL;
+  if (size >= sizeof (IMAGE_DOS_HEADER) && size <= 0xFFFFFFFFU)
+    buf = (unsigned char *) AllocImageBuffer (size);
+  if (buf == NULL)
   {
-    idd = (IMAGE_DELAYLOAD_DESCRIPTOR *) MapPointer (soffs, soffs_len, idata->VirtualAddress, NULL);
-    if (idd)
-      for (i = 0; idd[i].Attributes.AllAttributes || idd[i].DllNameRVA ||
-          idd[i].ModuleHandleRVA || idd[i].ImportAddressTableRVA || idd[i].ImportNameTableRVA ||
-          idd[i].BoundImportAddressTableRVA || idd[i].UnloadInformationTableRVA ||
-          idd[i].TimeDateStamp; i++)
+    CloseImageFile (h);
+    SetLastError (ENOEXEC);
+    return FALSE;
+  }
+
+  have = size < 4096 ? size : 4096;
+  if (PartialReadRange (loader, h, buf, size, 0, (DWORD) have))
+  {
+    dos = (PIMAGE_DOS_HEADER) buf;
+    if (dos->e_magic == IMAGE_DOS_SIGNATURE && dos->e_lfanew >= 0 &&
+        (uint64_t) dos->e_lfanew + sizeof (IMAGE_NT_HEADERS) <= size)
+    {
+      uint64_t end = (uint64_t) dos->e_lfanew + sizeof (IMAGE_NT_HEADERS);
+      if (end > have && PartialReadRange (loader, h, buf, size, (DWORD) have, (DWORD) (end - have)))
+        have = end;
+      if (end <= have)
       {
-        struct DepTreeElement *dll;
-        uint64_t impaddress;
-        dll = ProcessDep (cfg, soffs, soffs_len, idd[i].DllNameRVA, root, self, 0);
-        if (dll == NULL)
-          continue;
-        if (idd[i].Attributes.AllAttributes & 0x00000001)
+        PIMAGE_NT_HEADERS hdr = (PIMAGE_NT_HEADERS) (buf + dos->e_lfanew);
+        end = (uint64_t) dos->e_lfanew + sizeof (DWORD) + sizeof (IMAGE_FILE_HEADER) +
+            hdr->FileHeader.SizeOfOptionalHeader + hdr->FileHeader.NumberOfSections * sizeof (IMAGE_SECTION_HEADER);
+        if (end > have && end <= size && PartialReadRange (loader, h, buf, size, (DWORD) have, (DWORD) (end - have)))
+          have = end;
+        nt = CheckImageHeaders (buf, have);
+      }
+    }
+  }
+  if (nt == NULL)
+  {
+    FreeImageBuffer (buf, size);
+    CloseImageFile (h);
+    SetLastError (ENOEXEC);
+    return FALSE;
+  }
+#ifdef _WIN32
+  {
+    LPSTR module_name = LocalAlloc (LPTR, strlen (found) + 1);
+    if (module_name) strcpy (module_name, found);
+    FillLoadedImage (img, module_name, h, buf, nt, size);
+  }
+#else
+  FillLoadedImage (img, strdup (found), h, buf, nt, size);
+#endif
+  loader->images_loaded += 1;
+  return TRUE;
+}
+
+static BOOL PartialLoadRange (ImageLoader *loader, PLOADED_IMAGE img, DWORD offset, DWORD size)
+{
+  /* Skip whatever PartialMapAndLoad () has already read */
+  DWORD have = img->SizeOfImage < 4096 ? img->SizeOfImage : 4096;
+  DWORD table_end = (DWORD) ((LPBYTE) (img->Sections + img->NumberOfSections) - img->MappedAddress);
+  if (table_end > have)
+    have = table_end;
+  if (offset < have)
+  {
+    if ((uint64_t) offset + size <= have)
+      return TRUE;
+    size -= have - offset;
+    offset = have;
+  }
+  return PartialReadRange (loader, img->hFile, img->MappedAddress, img->SizeOfImage, offset, size);
+}
+
+static BOOL PartialUnMapAndLoad (ImageLoader *loader, PLOADED_IMAGE img)
+{
+  (void) loader;
+#ifdef _WIN32
+  LocalFree (img->ModuleName);
+#else
+  free (img->ModuleName);
+#endif
+  FreeImageBuffer (img->MappedAddress, img->SizeOfImage);
+  CloseImageFile (img->hFile);
+  return TRUE;
+}
+
+static ImageLoader image_loaders[] =
+{
+#ifdef _WIN32
+  { "win32", Win32MapAndLoad, Win32UnMapAndLoad, NULL, 0, 0, 0 },
+#else
+  { "mmap", PosixMapAndLoad, PosixUnMapAndLoad, NULL, 0, 0, 0 },
+#endif
+  { "partial", PartialMapAndLoad, PartialUnMapAndLoad, PartialLoadRange, 0, 0, 0 },
+};
+
+ImageLoader *GetImageLoader (const char *name)
+{
+  size_t i;
+  if (name == NULL)
+    return &image_loaders[0];
+  for (i = 0; i < sizeof (image_loaders) / sizeof (image_loaders[0]); i++)
+    if (strcmp (image_loaders[i].name, name) == 0)
+      return &image_loaders[i];
+  return NULL;
+}
+
+typedef struct _soff_entry soff_entry;
+typedef struct _soff_range soff_range;
+typedef struct _soff_table soff_table;
+
+struct _soff_entry
+{
+  DWORD start;
+  DWORD end;
+  char *off;
+};
+
+/* RVA space is cut into ranges that are each covered by the same set
+ * of sections, and every range remembers which section the old linear
+ * scan would have settled on. A range ends where the next one starts;
+ * the last one never has a section.
+ */
+struct _soff_range
+{
+  uint64_t start;
+  int section;
+};
+
+struct _soff_table
+{
+  soff_entry *soffs;
+  int soffs_len;
+  /* for MapPointer () */
+  soff_range *ranges;
+  int ranges_len;
+  int last_range;
+  /* for FindSectionByRawData () */
+  soff_range *raw_ranges;
+  int raw_ranges_len;
+  int last_raw_range;
+  /* Set when the loader reads sections on demand: pending[i] is 1
+   * until the raw data of section i has been loaded, 2 if that failed
+   */
+  ImageLoader *loader;
+  LOADED_IMAGE *img;
+  char *pending;
+};
+
+static int CompareU64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static int FindBound (uint64_t *bounds, int bounds_len, uint64_t value)
+{
+  int lo = 0, hi = bounds_len - 1;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (bounds[mid] < value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int NextUnpainted (int *next, int k)
+{
+  int root = k, tmp;
+  while (next[root] != root)
+    root = next[root];
+  while (next[k] != root)
+  {
+    tmp = next[k];
+    next[k] = root;
+    k = tmp;
+  }
+  return root;
+}
+
+/* Section i covers [starts[i], ends[i]). Sections are applied in the
+ * given order, each one only claiming the parts of RVA space that no
+ * earlier section in that order has claimed yet. Returns the number
+ * of ranges, or -1 if out of memory.
+ */
+static int BuildRanges (uint64_t *starts, uint64_t *ends, int n, int *order, int order_len, soff_range **result)
+{
+  uint64_t *bounds;
+  int *painted, *next;
+  int bounds_len = 0, ranges_len = 0, i, k;
+  soff_range *ranges;
+
+  *result = NULL;
+  bounds = (uint64_t *) malloc (sizeof (uint64_t) * (n * 2 + 1));
+  if (bounds == NULL)
+    return -1;
+  for (i = 0; i < n; i++)
+  {
+    if (ends[i] <= starts[i])
+      continue;
+    bounds[bounds_len++] = starts[i];
+    bounds[bounds_len++] = ends[i];
+  }
+  if (bounds_len == 0)
+  {
+    free (bounds);
+    return 0;
+  }
+  qsort (bounds, bounds_len, sizeof (uint64_t), CompareU64);
+  for (i = 1, k = 1; i < bounds_len; i++)
+    if (bounds[i] != bounds[k - 1])
+      bounds[k++] = bounds[i];
+  bounds_len = k;
+
+  painted = (int *) malloc (sizeof (int) * bounds_len);
+  next = (int *) malloc (sizeof (int) * bounds_len);
+  ranges = (soff_range *) malloc (sizeof (soff_range) * bounds_len);
+  if (painted == NULL || next == NULL || ranges == NULL)
+  {
+    free (bounds);
+    free (painted);
+    free (next);
+    free (ranges);
+    return -1;
+  }
+  for (k = 0; k < bounds_len; k++)
+  {
+    painted[k] = -1;
+    next[k] = k;
+  }
+  for (i = 0; i < order_len; i++)
+  {
+    int sec = order[i], hi;
+    if (ends[sec] <= starts[sec])
+      continue;
+    hi = FindBound (bounds, bounds_len, ends[sec]);
+    for (k = NextUnpainted (next, FindBound (bounds, bounds_len, starts[sec])); k < hi; k = NextUnpainted (next, k + 1))
+    {
+      painted[k] = sec;
+      next[k] = k + 1;
+    }
+  }
+
+  for (k = 0; k < bounds_len; k++)
+  {
+    if (ranges_len > 0 && ranges[ranges_len - 1].section == painted[k])
+      continue;
+    ranges[ranges_len].start = bounds[k];
+    ranges[ranges_len].section = painted[k];
+    ranges_len++;
+  }
+  free (bounds);
+  free (painted);
+  free (next);
+  *result = ranges;
+  return ranges_len;
+}
+
+static int LookupRange (soff_range *ranges, int ranges_len, int *last, DWORD in_ptr)
+{
+  int lo, hi;
+  if (ranges_len == 0 || in_ptr < ranges[0].start)
+    return -1;
+  lo = *last;
+  if (ranges[lo].start <= in_ptr && (lo + 1 == ranges_len || in_ptr < ranges[lo + 1].start))
+    return ranges[lo].section;
+  lo = 0;
+  hi = ranges_len - 1;
+  while (lo < hi)
+  {
+    int mid = hi - (hi - lo) / 2;
+    if (ranges[mid].start <= in_ptr)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  *last = lo;
+  return ranges[lo].section;
+}
+
+/* Returns -1 if out of memory; table is then still to be freed */
+static int BuildSoffTable (soff_table *table, soff_entry *soffs, int soffs_len, LOADED_IMAGE *img)
+{
+  uint64_t *starts, *ends;
+  int *order;
+  int i, order_len = 0, ok;
+
+  memset (table, 0, sizeof (soff_table));
+  table->soffs = soffs;
+  table->soffs_len = soffs_len;
+  table->img = img;
+  if (soffs_len <= 0)
+    return 0;
+  starts = (uint64_t *) malloc (sizeof (uint64_t) * soffs_len);
+  ends = (uint64_t *) malloc (sizeof (uint64_t) * soffs_len);
+  order = (int *) malloc (sizeof (int) * soffs_len * 2);
+  if (starts == NULL || ends == NULL || order == NULL)
+  {
+    free (starts);
+    free (ends);
+    free (order);
+    return -1;
+  }
+
+  /* MapPointer () returns the first covering section that has data,
+   * otherwise it reports the last covering section and returns NULL
+   */
+  for (i = 0; i < soffs_len; i++)
+  {
+    starts[i] = soffs[i].start;
+    ends[i] = soffs[i].end >= soffs[i].start ? (uint64_t) soffs[i].end + 1 : 0;
+    if (soffs[i].off)
+      order[order_len++] = i;
+  }
+  for (i = soffs_len - 1; i >= 0; i--)
+    order[order_len++] = i;
+  table->ranges_len = BuildRanges (starts, ends, soffs_len, order, order_len, &table->ranges);
+  ok = table->ranges_len >= 0;
+
+  /* FindSectionByRawData () returns the first covering section */
+  for (i = 0; i < soffs_len; i++)
+  {
+    DWORD start = img->Sections[i].VirtualAddress;
+    DWORD end = start + img->Sections[i].SizeOfRawData;
+    starts[i] = start;
+    ends[i] = end > start ? end : 0;
+    order[i] = i;
+  }
+  table->raw_ranges_len = BuildRanges (starts, ends, soffs_len, order, soffs_len, &table->raw_ranges);
+  ok = ok && table->raw_ranges_len >= 0;
+
+  free (starts);
+  free (ends);
+  free (order);
+  return ok ? 0 : -1;
+}
+
+/* Returns -1 if out of memory */
+static int LoadSectionsOnDemand (soff_table *table, ImageLoader *loader, LOADED_IMAGE *img)
+{
+  ULONG i;
+  table->loader = loader;
+  table->img = img;
+  table->pending = (char *) calloc (img->NumberOfSections + 1, 1);
+  if (table->pending == NULL)
+    return -1;
+  for (i = 0; i < img->NumberOfSections; i++)
+    table->pending[i] = img->Sections[i].PointerToRawData != 0 && img->Sections[i].SizeOfRawData != 0;
+  return 0;
+}
+
+static void FreeSoffTable (soff_table *table)
+{
+  free (table->ranges);
+  free (table->raw_ranges);
+  free (table->pending);
+}
+
+/* Translates an RVA without making the memory behind it readable */
+static void *MapAddress (soff_table *soffs, DWORD in_ptr, int *section)
+{
+  int i = LookupRange (soffs->ranges, soffs->ranges_len, &soffs->last_range, in_ptr);
+  if (i < 0)
+    return NULL;
+  if (section != NULL)
+    *section = i;
+  if (soffs->soffs[i].off)
+    return soffs->soffs[i].off + in_ptr;
+  return NULL;
+}
+
+void *MapPointer (soff_table *soffs, DWORD in_ptr, int *section)
+{
+  int i = LookupRange (soffs->ranges, soffs->ranges_len, &soffs->last_range, in_ptr);
+  if (i < 0)
+    return NULL;
+  if (section != NULL)
+    *section = i;
+  if (soffs->pending != NULL && soffs->pending[i])
+  {
+    IMAGE_SECTION_HEADER *sec = &soffs->img->Sections[i];
+    if (soffs->pending[i] == 1)
+      soffs->pending[i] = soffs->loader->load_range (soffs->loader, soffs->img,
+          sec->PointerToRawData, sec->SizeOfRawData) ? 0 : 2;
+    if (soffs->pending[i])
+      return NULL;
+  }
+  if (soffs->soffs[i].off)
+    return soffs->soffs[i].off + in_ptr;
+  return NULL;
+}
+
+/* Like MapPointer (), also setting *avail to the number of bytes from
+ * there on that are backed by both the section's raw data and the
+ * image, which is how far a scan may read without a terminator
+ */
+static void *MapPointerAvail (soff_table *soffs, DWORD in_ptr, size_t *avail)
+{
+  int i = -1;
+  char *p = (char *) MapPointer (soffs, in_ptr, &i);
+  IMAGE_SECTION_HEADER *sec;
+  uint64_t end;
+
+  *avail = 0;
+  if (p == NULL)
+    return NULL;
+  sec = &soffs->img->Sections[i];
+  end = (uint64_t) sec->VirtualAddress + sec->SizeOfRawData;
+  if ((uint64_t) soffs->soffs[i].end < end)
+    end = soffs->soffs[i].end;
+  if (in_ptr < end)
+    *avail = (size_t) (end - in_ptr);
+  /* Images read from files know their size, images of ourselves don't */
+  if (soffs->img->SizeOfImage != 0)
+  {
+    char *image_end = (char *) soffs->img->MappedAddress + soffs->img->SizeOfImage;
+    if (p >= image_end)
+      *avail = 0;
+    else if ((size_t) (image_end - p) < *avail)
+      *avail = (size_t) (image_end - p);
+  }
+  return p;
+}
+
+/*
+int FindSectionID (IMAGE_OPTIONAL_HEADER *oh, DWORD address, DWORD size)
+{
+  int i;
+  for (i = 0; i < oh->NumberOfRvaAndSizes; i++)
+  {
+    if (oh->DataDirectory[i].VirtualAddress == address &&
+        oh->DataDirectory[i].Size == size)
+      return i;
+  }
+  return -1;
+}
+*/
+
+int FindSectionByRawData (soff_table *soffs, DWORD address)
+{
+  return LookupRange (soffs->raw_ranges, soffs->raw_ranges_len, &soffs->last_raw_range, address);
+}
+
+/* Doubles the array, zeroing the new half. Returns -1, leaving the
+ * array as it was, if it could not be grown.
+ */
+int ResizeArray (void **data, uint64_t *data_size, size_t sizeof_data)
+{
+#ifdef _MIPS_
+  size_t new_size;
+#else
+  uint64_t new_size;
+#endif
+  void *new_data;
+  new_size = (*data_size) > 0 ? (*data_size) * 2 : 64;
+  if (new_size < *data_size || new_size > (size_t) -1 / sizeof_data)
+    return -1;
+  new_data = (unsigned char *) realloc (*data, (size_t) (new_size * sizeof_data));
+  if (new_data == NULL)
+    return -1;
+  memset (((unsigned char *) new_data) + (*data_size * sizeof_data), 0, (size_t)((new_size - (*data_size)) * sizeof_data));
+  *data = new_data;
+  *data_size = new_size;
+  return 0;
+}
+
+/* Bump allocator. Everything a dependency tree points to lives in the
+ * arena of its root and is released at once by DestroyDepTree ().
+ * blocks is the block being filled, followed by full ones.
+ */
+struct ArenaBlock
+{
+  struct ArenaBlock *next;
+  size_t used;
+  size_t size;
+};
+
+struct Arena
+{
+  struct ArenaBlock *blocks;
+  struct ArenaBlock *last;
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+/* Blocks start small and double, so that the arena of a small
+ * module does not cost a full block
+ */
+#define ARENA_FIRST_BLOCK (4 * 1024)
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof (struct ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/* Returns NULL if there is no memory left */
+static void *ArenaBump (struct Arena *arena, size_t size, size_t align)
+{
+  struct ArenaBlock *block = arena->blocks;
+  size_t at;
+
+  at = block != NULL ? (block->used + align - 1) & ~(align - 1) : 0;
+  if (block == NULL || at + size > block->size)
+  {
+    /* Large allocations get a block of their own, behind the one
+     * being filled
+     */
+    size_t block_size = block == NULL ? ARENA_FIRST_BLOCK : block->size * 2;
+    struct ArenaBlock *fresh;
+    int large;
+    if (block_size > ARENA_BLOCK_SIZE)
+      block_size = ARENA_BLOCK_SIZE;
+    large = size > block_size / 4;
+    if (large)
+      block_size = size;
+    if (block_size > (size_t) -1 - ARENA_HEADER)
+      return NULL;
+    fresh = (struct ArenaBlock *) malloc (ARENA_HEADER + block_size);
+    if (fresh == NULL)
+      return NULL;
+    fresh->used = 0;
+    fresh->size = block_size;
+    if (large && block != NULL)
+    {
+      fresh->next = block->next;
+      block->next = fresh;
+      if (arena->last == block)
+        arena->last = fresh;
+    }
+    else
+    {
+      fresh->next = block;
+      arena->blocks = fresh;
+      if (arena->last == NULL)
+        arena->last = fresh;
+    }
+    block = fresh;
+    at = 0;
+  }
+  block->used = at + size;
+  arena->allocations += 1;
+  arena->bytes += size;
+  return (char *) block + ARENA_HEADER + at;
+}
+
+static void *ArenaAlloc (struct Arena *arena, size_t size)
+{
+  void *p = ArenaBump (arena, size, ARENA_ALIGN);
+  if (p != NULL)
+    memset (p, 0, size);
+  return p;
+}
+
+static char *ArenaStrdup (struct Arena *arena, const char *s)
+{
+  size_t len;
+  char *p;
+  if (s == NULL)
+    return NULL;
+  len = strlen (s) + 1;
+  p = (char *) ArenaBump (arena, len, 1);
+  if (p != NULL)
+    memcpy (p, s, len);
+  return p;
+}
+
+/* Makes the next size bytes allocated come from a single block, so
+ * that what is allocated together also lies together
+ */
+static void ArenaReserve (struct Arena *arena, size_t size)
+{
+  struct ArenaBlock *block = arena->blocks, *fresh;
+  size_t block_size;
+
+  /* Room for aligning the first allocation */
+  size += ARENA_ALIGN;
+  if (block != NULL && ((block->used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1)) + size <= block->size)
+    return;
+  block_size = block == NULL ? ARENA_FIRST_BLOCK : block->size * 2;
+  if (block_size > ARENA_BLOCK_SIZE)
+    block_size = ARENA_BLOCK_SIZE;
+  if (block_size < size)
+    block_size = size;
+  fresh = (struct ArenaBlock *) malloc (ARENA_HEADER + block_size);
+  /* Only a hint: ArenaBump () reports the failure when it matters */
+  if (fresh == NULL)
+    return;
+  fresh->used = 0;
+  fresh->size = block_size;
+  fresh->next = block;
+  arena->blocks = fresh;
+  if (arena->last == NULL)
+    arena->last = fresh;
+}
+
+/* Like ResizeArray (); the old array stays in the arena */
+static int ArenaResizeArray (struct Arena *arena, void **data, uint64_t *data_size, size_t sizeof_data)
+{
+  uint64_t new_size = (*data_size) > 0 ? (*data_size) * 2 : 64;
+  void *new_data;
+  if (new_size > (size_t) -1 / sizeof_data)
+    return -1;
+  new_data = ArenaAlloc (arena, (size_t) (new_size * sizeof_data));
+  if (new_data == NULL)
+    return -1;
+  if (*data != NULL)
+    memcpy (new_data, *data, (size_t) (*data_size * sizeof_data));
+  *data = new_data;
+  *data_size = new_size;
+  return 0;
+}
+
+/* Moves everything allocated from from into to */
+static void ArenaAdopt (struct Arena *to, struct Arena *from)
+{
+  if (from->blocks == NULL)
+    return;
+  if (to->blocks == NULL)
+  {
+    to->blocks = from->blocks;
+    to->last = from->last;
+  }
+  else
+  {
+    from->last->next = to->blocks->next;
+    to->blocks->next = from->blocks;
+    if (to->last == to->blocks)
+      to->last = from->last;
+  }
+  to->allocations += from->allocations;
+  to->bytes += from->bytes;
+  memset (from, 0, sizeof (struct Arena));
+}
+
+static void ArenaFree (struct Arena *arena)
+{
+  struct ArenaBlock *block, *next;
+  for (block = arena->blocks; block != NULL; block = next)
+  {
+    next = block->next;
+    free (block);
+  }
+  memset (arena, 0, sizeof (struct Arena));
+}
+
+static struct DepTreeElement *DepRoot (struct DepTreeElement *dep)
+{
+  for (; dep->parent != NULL; dep = dep->parent)
+    ;
+  return dep;
+}
+
+/* Returns NULL if out of memory */
+static struct Arena *DepArena (struct DepTreeElement *root)
+{
+  if (root->arena == NULL)
+    root->arena = (struct Arena *) calloc (1, sizeof (struct Arena));
+  return root->arena;
+}
+
+struct DepTreeElement *NewDep (struct DepTreeElement *root, const char *module)
+{
+  struct Arena *arena = DepArena (root);
+  struct DepTreeElement *dep;
+  if (arena == NULL)
+    return NULL;
+  dep = (struct DepTreeElement *) ArenaAlloc (arena, sizeof (struct DepTreeElement));
+  if (dep == NULL)
+    return NULL;
+  dep->module = ArenaStrdup (arena, module);
+  if (module != NULL && dep->module == NULL)
+    return NULL;
+  return dep;
+}
+
+struct DepIndex
+{
+  uint64_t size;
+  uint64_t len;
+  struct DepTreeElement **slots;
+};
+
+static DWORD HashName (const char *name)
+{
+  DWORD h = 2166136261U;
+  for (; *name; name++)
+    h = (h ^ (unsigned char) *name) * 16777619U;
+  return h;
+}
+
+/* Case-folded FNV-1a, so that names differing only in case
+ * (as far as stricmp () is concerned) land in the same bucket
+ */
+static DWORD HashNameI (const char *name)
+{
+  DWORD h = 2166136261U;
+  for (; *name; name++)
+  {
+    unsigned char c = (unsigned char) *name;
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    h = (h ^ c) * 16777619U;
+  }
+  return h;
+}
+
+/* Returns -1 if the index could not be grown */
+static int DepIndexInsert (struct DepIndex *index, struct DepTreeElement *dep)
+{
+  uint64_t i;
+  if ((index->len + 1) * 2 > index->size)
+  {
+    struct DepIndex grown;
+    grown.size = index->size > 0 ? index->size * 2 : 64;
+    grown.len = 0;
+    grown.slots = (struct DepTreeElement **) calloc ((size_t) grown.size, sizeof (struct DepTreeElement *));
+    if (grown.slots == NULL)
+      return -1;
+    for (i = 0; i < index->size; i++)
+      if (index->slots[i] != NULL)
+        DepIndexInsert (&grown, index->slots[i]);
+    free (index->slots);
+    *index = grown;
+  }
+  for (i = HashNameI (dep->module) & (index->size - 1); index->slots[i] != NULL; i = (i + 1) & (index->size - 1))
+    ;
+  index->slots[i] = dep;
+  index->len += 1;
+  return 0;
+}
+
+/* Every distinct name of a tree that is matched or kept compact,
+ * once. Names that went through InternSymbol () are equal only if
+ * they are the same pointer.
+ */
+struct SymbolTable
+{
+  /* Symbol ids are index + 1 */
+  char **symbols;
+  uint64_t symbols_len;
+  uint64_t symbols_size;
+  /* Open-addressing hash, slots hold ids */
+  DWORD *slots;
+  DWORD slots_size;
+  uint64_t interned;
+  uint64_t duplicate_bytes;
+};
+
+/* Returns NULL if out of memory */
+static struct SymbolTable *DepSymbols (struct DepTreeElement *root)
+{
+  if (root->symbols == NULL)
+    root->symbols = (struct SymbolTable *) calloc (1, sizeof (struct SymbolTable));
+  return root->symbols;
+}
+
+static char *SymbolString (struct SymbolTable *table, DWORD id)
+{
+  return id != 0 ? table->symbols[id - 1] : NULL;
+}
+
+static DWORD SymbolSlot (struct SymbolTable *table, const char *s)
+{
+  DWORD slot;
+  for (slot = HashName (s) & (table->slots_size - 1); table->slots[slot] != 0; slot = (slot + 1) & (table->slots_size - 1))
+    if (strcmp (table->symbols[table->slots[slot] - 1], s) == 0)
+      break;
+  return slot;
+}
+
+/* Returns the id of s, or 0 if s is NULL or was never interned */
+static DWORD FindSymbol (struct SymbolTable *table, const char *s)
+{
+  if (s == NULL || table == NULL || table->symbols_len == 0)
+    return 0;
+  return table->slots[SymbolSlot (table, s)];
+}
+
+/* Returns the id of s, adding s if it is new: a copy in arena, or
+ * with copy 0 s itself, which then has to live as long as the tree.
+ * Returns 0 for NULL, or if there is no memory left for s.
+ */
+static DWORD InternSymbol (struct SymbolTable *table, struct Arena *arena, char *s, int copy)
+{
+  DWORD slot;
+  char *symbol;
+  if (s == NULL || table == NULL)
+    return 0;
+  table->interned += 1;
+  if ((table->symbols_len + 1) * 2 > table->slots_size)
+  {
+    DWORD *slots = (DWORD *) calloc (table->slots_size > 0 ? table->slots_size * 2 : 1024, sizeof (DWORD));
+    uint64_t i;
+    if (slots == NULL)
+      return 0;
+    free (table->slots);
+    table->slots = slots;
+    table->slots_size = table->slots_size > 0 ? table->slots_size * 2 : 1024;
+    for (i = 0; i < table->symbols_len; i++)
+    {
+      for (slot = HashName (table->symbols[i]) & (table->slots_size - 1); table->slots[slot] != 0; slot = (slot + 1) & (table->slots_size - 1))
+        ;
+      table->slots[slot] = (DWORD) i + 1;
+    }
+  }
+  slot = SymbolSlot (table, s);
+  if (table->slots[slot] != 0)
+  {
+    table->duplicate_bytes += strlen (s) + 1;
+    return table->slots[slot];
+  }
+  if (table->symbols_len >= table->symbols_size &&
+      ResizeArray ((void **) &table->symbols, &table->symbols_size, sizeof (char *)) != 0)
+    return 0;
+  symbol = copy ? ArenaStrdup (arena, s) : s;
+  if (symbol == NULL)
+    return 0;
+  table->symbols[table->symbols_len] = symbol;
+  table->symbols_len += 1;
+  return table->slots[slot] = (DWORD) table->symbols_len;
+}
+
+void GetSymbolStats (struct DepTreeElement *root, uint64_t *interned, uint64_t *distinct, uint64_t *duplicate_bytes)
+{
+  struct SymbolTable *table = root->symbols;
+  *interned = table != NULL ? table->interned : 0;
+  *distinct = table != NULL ? table->symbols_len : 0;
+  *duplicate_bytes = table != NULL ? table->duplicate_bytes : 0;
+}
+
+int AddDep (struct DepTreeElement *parent, struct DepTreeElement *child)
+{
+  struct DepTreeElement *root = DepRoot (parent);
+  if (parent->childs_len >= parent->childs_size)
+  {
+    struct Arena *arena = DepArena (root);
+    if (arena == NULL || ArenaResizeArray (arena, (void **) &parent->childs, &parent->childs_size, sizeof (struct DepTreeElement *)) != 0)
+      return -1;
+  }
+  parent->childs[parent->childs_len] = child;
+  parent->childs_len += 1;
+  child->parent = parent;
+  if (child->module == NULL)
+    return 0;
+  if (root->index == NULL)
+    root->index = (struct DepIndex *) calloc (1, sizeof (struct DepIndex));
+  if (root->index == NULL || DepIndexInsert (root->index, child) != 0)
+    return -1;
+  return 0;
+}
+
+void DestroyDepTree (struct DepTreeElement *root)
+{
+  if (root->index != NULL)
+  {
+    free (root->index->slots);
+    free (root->index);
+  }
+  if (root->symbols != NULL)
+  {
+    free (root->symbols->symbols);
+    free (root->symbols->slots);
+    free (root->symbols);
+  }
+  if (root->arena != NULL)
+  {
+    ArenaFree (root->arena);
+    free (root->arena);
+  }
+  memset (root, 0, sizeof (struct DepTreeElement));
+}
+
+struct ImportTableItem *AddImport (struct DepTreeElement *self)
+{
+  if (self->imports_len >= self->imports_size)
+  {
+    struct Arena *arena = DepArena (DepRoot (self));
+    if (arena == NULL || ArenaResizeArray (arena, (void **) &self->imports, &self->imports_size, sizeof (struct ImportTableItem)) != 0)
+      return NULL;
+  }
+  self->imports_len += 1;
+  return &self->imports[self->imports_len - 1];
+}
+
+static uint64_t DepDepth (struct DepTreeElement *dep)
+{
+  uint64_t depth = 0;
+  for (; dep->parent != NULL; dep = dep->parent)
+    depth++;
+  return depth;
+}
+
+static uint64_t DepChildIndex (struct DepTreeElement *dep)
+{
+  uint64_t i;
+  for (i = 0; dep->parent->childs[i] != dep; i++)
+    ;
+  return i;
+}
+
+/* Returns non-zero if the old recursive FindDep would have reached
+ * a before b: parents are visited in pre-order, and each parent's
+ * childs are checked in order before descending into them.
+ */
+static int DepFoundBefore (struct DepTreeElement *a, struct DepTreeElement *b)
+{
+  struct DepTreeElement *pa = a->parent, *pb = b->parent;
+  uint64_t da, db;
+  if (pa == pb)
+    return DepChildIndex (a) < DepChildIndex (b);
+  da = DepDepth (pa);
+  db = DepDepth (pb);
+  for (; da > db; da--)
+    pa = pa->parent;
+  for (; db > da; db--)
+    pb = pb->parent;
+  if (pa == a->parent && pa == pb)
+    return 1;
+  if (pb == b->parent && pa == pb)
+    return 0;
+  while (pa->parent != pb->parent)
+  {
+    pa = pa->parent;
+    pb = pb->parent;
+  }
+  return DepChildIndex (pa) < DepChildIndex (pb);
+}
+
+int FindDep (struct DepTreeElement *root, char *name, int machineType, struct DepTreeElement **result)
+{
+  struct DepIndex *index = root->index;
+  struct DepTreeElement *found = NULL;
+  uint64_t i;
+  if (index == NULL)
+    return -1;
+  /* machineType is matched here rather than hashed, because top-level
+   * modules only learn their machine type once they are loaded
+   */
+  for (i = HashNameI (name) & (index->size - 1); index->slots[i] != NULL; i = (i + 1) & (index->size - 1))
+  {
+    struct DepTreeElement *dep = index->slots[i];
+    if (dep->machineType == machineType && stricmp (dep->module, name) == 0 &&
+        (found == NULL || DepFoundBefore (dep, found)))
+      found = dep;
+  }
+  if (found == NULL)
+    return -1;
+  if (result != NULL)
+    *result = found;
+  return (found->flags & DEPTREE_UNRESOLVED) ? 1 : 0;
+}
+
+int BuildDepTree (BuildTreeConfig* cfg, char *name, struct DepTreeElement *root, struct DepTreeElement *self);
+
+/* Returns the element of dllname, adding it to the children of self
+ * if it is new, or NULL if dllname is on the stack. LinkModule ()
+ * builds the trees of what this returns once all are recorded.
+ */
+struct DepTreeElement *ProcessDep (BuildTreeConfig* cfg, char *dllname, struct DepTreeElement *root, struct DepTreeElement *self)
+{
+  struct DepTreeElement *child = NULL;
+  int found;
+  uint64_t t;
+  if (dllname == NULL)
+    return NULL;
+  if (StackContains (cfg->stack, dllname))
+    return NULL;
+  STATS_START (cfg, t);
+  found = FindDep (root, dllname, self->machineType, &child);
+  STATS_END (cfg, STATS_FINDDEP, t);
+  if (found < 0)
+  {
+    child = NewDep (root, dllname);
+    if (child != NULL)
+    {
+      child->machineType = self->machineType;
+      if (AddDep (self, child) != 0)
+        child = NULL;
+    }
+    /* Out of memory, the dependency is left out */
+    if (child == NULL)
+    {
+      cfg->out_of_memory = 1;
+      return NULL;
+    }
+  }
+  return child;
+}
+
+
+int ClearDepStatus (struct DepTreeElement *self, uint64_t flags)
+{
+  uint64_t i;
+  for (i = 0; i < self->childs_len; i++)
+    ClearDepStatus (self->childs[i], flags);
+  self->flags &= ~flags;
+  return 0;
+}
+
+/* Returns -1 if the set could not be grown */
+static int NameSetInsert (NameSet *set, struct NameSetEntry *entry)
+{
+  uint64_t i;
+  if ((set->len + 1) * 2 > set->size)
+  {
+    NameSet grown;
+    memset (&grown, 0, sizeof (grown));
+    grown.size = set->size > 0 ? set->size * 2 : 64;
+    grown.entries = (struct NameSetEntry *) calloc ((size_t) grown.size, sizeof (struct NameSetEntry));
+    if (grown.entries == NULL)
+      return -1;
+    for (i = 0; i < set->size; i++)
+      if (set->entries[i].name != NULL)
+        NameSetInsert (&grown, &set->entries[i]);
+    free (set->entries);
+    set->entries = grown.entries;
+    set->size = grown.size;
+    set->len = grown.len;
+  }
+  for (i = entry->hash & (set->size - 1); set->entries[i].name != NULL; i = (i + 1) & (set->size - 1))
+    ;
+  set->entries[i] = *entry;
+  set->len += 1;
+  return 0;
+}
+
+static struct NameSetEntry *NameSetFind (NameSet *set, char *name, DWORD hash, uint64_t *probes)
+{
+  uint64_t i;
+  *probes = 0;
+  if (set->size == 0)
+    return NULL;
+  for (i = hash & (set->size - 1); set->entries[i].name != NULL; i = (i + 1) & (set->size - 1))
+  {
+    if (set->entries[i].hash != hash)
+      continue;
+    *probes += 1;
+    if (stricmp (set->entries[i].name, name) == 0)
+      return &set->entries[i];
+  }
+  return NULL;
+}
+
+int StackContains (NameSet *stack, char *name)
+{
+  uint64_t probes, linear;
+  struct NameSetEntry *entry = NameSetFind (stack, name, HashNameI (name), &probes);
+  /* The old stack was scanned from the top, so a hit cost one
+   * comparison per name pushed after it, and a miss cost all of them
+   */
+  linear = entry != NULL ? stack->pushes - entry->pushed_at : stack->pushes;
+  stack->lookups += 1;
+  if (linear > probes)
+    stack->probes_saved += linear - probes;
+  return entry != NULL;
+}
+
+int PushStack (NameSet *stack, char *name)
+{
+  uint64_t probes;
+  struct NameSetEntry entry;
+  entry.hash = HashNameI (name);
+  entry.pushed_at = stack->pushes;
+  stack->pushes += 1;
+  if (NameSetFind (stack, name, entry.hash, &probes) != NULL)
+    return 0;
+  entry.name = strdup (name);
+  if (entry.name == NULL)
+    return -1;
+  if (NameSetInsert (stack, &entry) != 0)
+  {
+    free (entry.name);
+    return -1;
+  }
+  return 0;
+}
+
+void ClearStack (NameSet *stack)
+{
+  uint64_t i;
+  for (i = 0; i < stack->size; i++)
+    free (stack->entries[i].name);
+  free (stack->entries);
+  stack->entries = NULL;
+  stack->size = 0;
+  stack->len = 0;
+}
+
+/* Everything BuildDepTree () takes from an image. Images are parsed
+ * into one of these and unmapped before the result is linked into the
+ * tree, which lets PrefetchModules () parse them on other threads.
+ */
+struct ParsedImportDesc
+{
+  /* NULL if the name could not be mapped */
+  char *dll_name;
+  uint64_t imports_len;
+  uint64_t imports_size;
+  struct ImportTableItem *imports;
+};
+
+struct ParsedModule
+{
+  /* Strings and exports; taken over by the tree on linking */
+  struct Arena arena;
+  /* BuildDepTree () return value, -1 if out of memory, and flags to
+   * set on failure
+   */
+  int result;
+  uint64_t flags;
+  char *resolved_module;
+  void *mapped_address;
+  int machineType;
+  int isPE32plus;
+  char *export_module;
+  uint64_t exports_len;
+  struct ExportTableItem *exports;
+  /* Import descriptors followed by delay-import descriptors. These
+   * arrays are malloc()ed, the imports are copied into the tree.
+   */
+  uint64_t descs_len;
+  uint64_t descs_size;
+  struct ParsedImportDesc *descs;
+};
+
+/* Number of entries before the zero that ends a thunk array of at
+ * most max entries, or max if there is no zero among them
+ */
+static DWORD CountThunks32 (const DWORD *thunks, DWORD max)
+{
+  DWORD i = 0;
+#if defined(THUNK_SCAN_AVX2)
+  for (; max - i >= 8; i += 8)
+  {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) &thunks[i]);
+    int zero = _mm256_movemask_epi8 (_mm256_cmpeq_epi32 (v, _mm256_setzero_si256 ()));
+    if (zero != 0)
+      return i + __builtin_ctz ((unsigned) zero) / 4;
+  }
+#elif defined(THUNK_SCAN_SSE2)
+  for (; max - i >= 4; i += 4)
+  {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) &thunks[i]);
+    int zero = _mm_movemask_epi8 (_mm_cmpeq_epi32 (v, _mm_setzero_si128 ()));
+    if (zero != 0)
+      return i + __builtin_ctz ((unsigned) zero) / 4;
+  }
+#endif
+  for (; i < max && thunks[i] != 0; i++)
+    ;
+  return i;
+}
+
+static DWORD CountThunks64 (const uint64_t *thunks, DWORD max)
+{
+  DWORD i = 0;
+#if defined(THUNK_SCAN_AVX2)
+  for (; max - i >= 4; i += 4)
+  {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) &thunks[i]);
+    int zero = _mm256_movemask_epi8 (_mm256_cmpeq_epi64 (v, _mm256_setzero_si256 ()));
+    if (zero != 0)
+      return i + __builtin_ctz ((unsigned) zero) / 8;
+  }
+#elif defined(THUNK_SCAN_SSE2)
+  for (; max - i >= 2; i += 2)
+  {
+    /* SSE2 has no 64-bit compare: both halves of an entry must be 0 */
+    __m128i halves = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i *) &thunks[i]), _mm_setzero_si128 ());
+    int zero = _mm_movemask_epi8 (_mm_and_si128 (halves, _mm_shuffle_epi32 (halves, _MM_SHUFFLE (2, 3, 0, 1))));
+    if (zero != 0)
+      return i + __builtin_ctz ((unsigned) zero) / 8;
+  }
+#endif
+  for (; i < max && thunks[i] != 0; i++)
+    ;
+  return i;
+}
+
+static DWORD CountThunks (const void *thunks, size_t avail, int isPE32plus)
+{
+  size_t max = avail / (isPE32plus ? sizeof (uint64_t) : sizeof (DWORD));
+  if (max > 0xFFFFFFFFU)
+    max = 0xFFFFFFFFU;
+  if (isPE32plus)
+    return CountThunks64 ((const uint64_t *) thunks, (DWORD) max);
+  return CountThunks32 ((const DWORD *) thunks, (DWORD) max);
+}
+
+/* Number of descriptors of size bytes before the all-zero one, within
+ * avail bytes
+ */
+static DWORD CountDescriptors (const void *descs, size_t size, size_t avail)
+{
+  const DWORD *d = (const DWORD *) descs;
+  size_t words = size / sizeof (DWORD), i, n;
+  for (n = 0; (n + 1) * size <= avail; n++, d += words)
+  {
+    DWORD any = 0;
+    for (i = 0; i < words; i++)
+      any |= d[i];
+    if (any == 0)
+      break;
+  }
+  return (DWORD) n;
+}
+
+static void *opt_header_get_dd_entry (void *opt_header, DWORD entry_type, int isPE32plus)
+{
+  if (!isPE32plus)
+    return &(((PIMAGE_OPTIONAL_HEADER32) opt_header)->DataDirectory[entry_type]);
+  else
+    return &(((PIMAGE_OPTIONAL_HEADER64) opt_header)->DataDirectory[entry_type]);
+}
+
+/* pm->descs is sized for every descriptor before they are added.
+ * Returns NULL if out of memory.
+ */
+static struct ParsedImportDesc *AddImportDesc (struct ParsedModule *pm, soff_table *soffs, DWORD name)
+{
+  struct ParsedImportDesc *desc;
+  char *dllname = (char *) MapPointer (soffs, name, NULL);
+  desc = &pm->descs[pm->descs_len++];
+  desc->dll_name = ArenaStrdup (&pm->arena, dllname);
+  if (dllname != NULL && desc->dll_name == NULL)
+    return NULL;
+  return desc;
+}
+
+/* Fills desc in from count thunks. ith holds the addresses, oith (if
+ * not NULL) the names or ordinals; entries with any of ordinal_flag's
+ * bits set are imported by ordinal. Returns -1 if out of memory.
+ */
+static int AddThunkImport (struct ParsedModule *pm, struct ParsedImportDesc *desc, soff_table *soffs, uint64_t impaddress,
+    uint64_t orig_address, int by_orig, int on_self, int is_delayed, uint64_t ordinal_flag)
+{
+  struct ImportTableItem *imp = &desc->imports[desc->imports_len++];
+  imp->ordinal = -1;
+  imp->is_delayed = is_delayed;
+  imp->orig_address = orig_address;
+  if (on_self)
+    imp->address = impaddress;
+  if (by_orig && (orig_address & ordinal_flag))
+    imp->ordinal = (int) (orig_address & 0x7FFFFFFF);
+  else if (by_orig || !is_delayed)
+  {
+    IMAGE_IMPORT_BY_NAME *byname = (IMAGE_IMPORT_BY_NAME *) MapPointer (soffs, (DWORD) orig_address, NULL);
+    if (byname != NULL)
+    {
+      imp->name = ArenaStrdup (&pm->arena, (char *) byname->Name);
+      if (imp->name == NULL)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* The thunk loops are written out for each bitness, so that neither
+ * tests it per entry. Delay-import thunks without a name table have
+ * no orig_address. Returns -1 if out of memory.
+ */
+static int ParseThunks (struct ParsedModule *pm, struct ParsedImportDesc *desc, soff_table *soffs,
+    void *ith, void *oith, DWORD count, int on_self, int is_delayed)
+{
+  DWORD j;
+  if (count == 0)
+    return 0;
+  desc->imports = (struct ImportTableItem *) calloc (count, sizeof (struct ImportTableItem));
+  if (desc->imports == NULL)
+    return -1;
+  desc->imports_size = count;
+  if (pm->isPE32plus)
+  {
+    uint64_t *addrs = (uint64_t *) ith, *origs = (uint64_t *) (oith != NULL ? oith : is_delayed ? NULL : ith);
+    /* Bit 63 marks ordinals; bits 31 to 62 never appear in names */
+    uint64_t flag = ~(uint64_t) 0x7FFFFFFF;
+    for (j = 0; j < count; j++)
+      if (AddThunkImport (pm, desc, soffs, addrs[j], origs != NULL ? origs[j] : 0, oith != NULL, on_self, is_delayed, flag) < 0)
+        return -1;
+  }
+  else
+  {
+    DWORD *addrs = (DWORD *) ith, *origs = (DWORD *) (oith != NULL ? oith : is_delayed ? NULL : ith);
+    for (j = 0; j < count; j++)
+      if (AddThunkImport (pm, desc, soffs, addrs[j], origs != NULL ? origs[j] : 0, oith != NULL, on_self, is_delayed, 0x80000000U) < 0)
+        return -1;
+  }
+  return 0;
+}
+
+/* Returns -1 if out of memory, leaving pm for FreeParsedModule () */
+static int ParseImage32or64 (LOADED_IMAGE *img, int on_self, struct ParsedModule *pm, soff_table *soffs)
+{
+  IMAGE_DATA_DIRECTORY *idata;
+  IMAGE_IMPORT_DESCRIPTOR *iid;
+  IMAGE_EXPORT_DIRECTORY *ied;
+  IMAGE_DELAYLOAD_DESCRIPTOR *idd;
+  void *ith, *oith;
+  void *opt_header = &img->FileHeader->OptionalHeader;
+  DWORD i, iid_len, idd_len;
+  size_t avail;
+
+  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_EXPORT, pm->isPE32plus);
+  if (idata->Size > 0 && idata->VirtualAddress != 0)
+  {
+    int export_section = -2;
+    ied = (IMAGE_EXPORT_DIRECTORY *) MapPointer (soffs, idata->VirtualAddress, &export_section);
+    if (ied && ied->Name != 0)
+    {
+      char *export_module = MapPointer (soffs, ied->Name, NULL);
+      if (export_module != NULL)
+      {
+        pm->export_module = ArenaStrdup (&pm->arena, export_module);
+        if (pm->export_module == NULL)
+          return -1;
+      }
+    }
+    if (ied && ied->NumberOfFunctions > 0)
+    {
+      DWORD *addrs, *names;
+      WORD *ords;
+      int section = -1;
+      size_t bytes;
+      addrs = (DWORD *) MapPointer (soffs, (DWORD)ied->AddressOfFunctions, NULL);
+      ords = (WORD *) MapPointer (soffs, (DWORD)ied->AddressOfNameOrdinals, NULL);
+      names = (DWORD *) MapPointer (soffs, (DWORD)ied->AddressOfNames, NULL);
+      /* The exports and every string they hold go in one block */
+      bytes = (size_t) (sizeof (struct ExportTableItem) * ied->NumberOfFunctions);
+      for (i = 0; ords && names && i < ied->NumberOfNames; i++)
+      {
+        char *s_name = names[i] != 0 ? (char *) MapPointer (soffs, names[i], NULL) : NULL;
+        if (s_name != NULL && ords[i] < ied->NumberOfFunctions)
+          bytes += strlen (s_name) + 1;
+      }
+      for (i = 0; addrs && i < ied->NumberOfFunctions; i++)
+      {
+        if (addrs[i] != 0 && (idata->VirtualAddress <= addrs[i]) && (idata->VirtualAddress + idata->Size > addrs[i]))
+        {
+          char *forward_str = (char *) MapPointer (soffs, addrs[i], NULL);
+          if (forward_str != NULL)
+            bytes += strlen (forward_str) + 1;
+        }
+      }
+      ArenaReserve (&pm->arena, bytes);
+      pm->exports = (struct ExportTableItem *) ArenaAlloc (&pm->arena, (size_t)(sizeof (struct ExportTableItem) * ied->NumberOfFunctions));
+      if (pm->exports == NULL)
+        return -1;
+      pm->exports_len = ied->NumberOfFunctions;
+      for (i = 0; ords && names && i < ied->NumberOfNames; i++)
+      {
+        /* Name ordinals past the address table name nothing */
+        if (ords[i] >= pm->exports_len)
+          continue;
+        pm->exports[ords[i]].ordinal = ords[i] + ied->Base;
+        if (names[i] != 0)
+        {
+          char *s_name = (char *) MapPointer (soffs, names[i], NULL);
+          if (s_name != NULL)
+          {
+            pm->exports[ords[i]].name = ArenaStrdup (&pm->arena, s_name);
+            if (pm->exports[ords[i]].name == NULL)
+              return -1;
+          }
+        }
+      }
+      for (i = 0; addrs && i < ied->NumberOfFunctions; i++)
+      {
+        if (addrs[i] != 0)
         {
-          ith = (void *) MapPointer (soffs, soffs_len, idd[i].ImportAddressTableRVA, NULL);
-          oith = (void *) MapPointer (soffs, soffs_len, idd[i].ImportNameTableRVA, NULL);
+          int section_index = FindSectionByRawData (soffs, addrs[i]);
+          if ((idata->VirtualAddress <= addrs[i]) && (idata->VirtualAddress + idata->Size > addrs[i]))
+          {
+            char *forward_str = (char *) MapPointer (soffs, addrs[i], NULL);
+            pm->exports[i].address = NULL;
+            pm->exports[i].forward_str = ArenaStrdup (&pm->arena, forward_str);
+            if (forward_str != NULL && pm->exports[i].forward_str == NULL)
+              return -1;
+          }
+          else
+            pm->exports[i].address = MapAddress (soffs, addrs[i], &section);
+          pm->exports[i].ordinal = i + ied->Base;
+          pm->exports[i].section_index = section_index;
+          pm->exports[i].address_offset = addrs[i];
         }
+      }
+    }
+  }
+
+  /* Descriptors are counted first, so that pm->descs is allocated once */
+  iid = NULL;
+  iid_len = 0;
+  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_IMPORT, pm->isPE32plus);
+  if (idata->Size > 0 && idata->VirtualAddress != 0)
+  {
+    iid = (IMAGE_IMPORT_DESCRIPTOR *) MapPointerAvail (soffs, idata->VirtualAddress, &avail);
+    if (iid)
+      iid_len = CountDescriptors (iid, sizeof (IMAGE_IMPORT_DESCRIPTOR), avail);
+  }
+  idd = NULL;
+  idd_len = 0;
+  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT, pm->isPE32plus);
+  if (idata->Size > 0 && idata->VirtualAddress != 0)
+  {
+    idd = (IMAGE_DELAYLOAD_DESCRIPTOR *) MapPointerAvail (soffs, idata->VirtualAddress, &avail);
+    if (idd)
+      idd_len = CountDescriptors (idd, sizeof (IMAGE_DELAYLOAD_DESCRIPTOR), avail);
+  }
+  if (iid_len + idd_len > 0)
+  {
+    pm->descs = (struct ParsedImportDesc *) calloc ((size_t) (iid_len + idd_len), sizeof (struct ParsedImportDesc));
+    if (pm->descs == NULL)
+      return -1;
+    pm->descs_size = iid_len + idd_len;
+  }
+
+  for (i = 0; i < iid_len; i++)
+  {
+    struct ParsedImportDesc *desc = AddImportDesc (pm, soffs, iid[i].Name);
+    size_t oavail;
+    DWORD count = 0;
+    if (desc == NULL)
+      return -1;
+    ith = MapPointerAvail (soffs, (DWORD)iid[i].FirstThunk, &avail);
+    oith = MapPointerAvail (soffs, (DWORD)iid[i].OriginalFirstThunk, &oavail);
+    if (ith)
+      count = CountThunks (ith, oith && oavail < avail ? oavail : avail, pm->isPE32plus);
+    if (ParseThunks (pm, desc, soffs, ith, oith, count, on_self, 0) < 0)
+      return -1;
+  }
+
+  for (i = 0; i < idd_len; i++)
+  {
+    struct ParsedImportDesc *desc = AddImportDesc (pm, soffs, idd[i].DllNameRVA);
+    size_t oavail;
+    DWORD count = 0;
+    if (desc == NULL)
+      return -1;
+    if (idd[i].Attributes.AllAttributes & 0x00000001)
+    {
+      ith = MapPointerAvail (soffs, idd[i].ImportAddressTableRVA, &avail);
+      oith = MapPointerAvail (soffs, idd[i].ImportNameTableRVA, &oavail);
+      if (ith)
+        count = CountThunks (ith, oith && oavail < avail ? oavail : avail, pm->isPE32plus);
+    }
+    else if (on_self)
+    {
+      /* Loaded and so readable up to the terminator, but of no known size */
+      ith = (void *) (size_t) idd[i].ImportAddressTableRVA;
+      oith = (void *) (size_t) idd[i].ImportNameTableRVA;
+      if (ith && pm->isPE32plus)
+        for (; ((uint64_t *) ith)[count] != 0; count++)
+          ;
+      else if (ith)
+        for (; ((DWORD *) ith)[count] != 0; count++)
+          ;
+    }
+    else
+    {
+      /* Old-style descriptors hold VAs, which only point into the
+       * image as it is loaded
+       */
+      ith = oith = NULL;
+    }
+    if (ParseThunks (pm, desc, soffs, ith, oith, count, on_self, 1) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static void FreeParsedModule (struct ParsedModule *pm)
+{
+  uint64_t i;
+  if (pm == NULL)
+    return;
+  for (i = 0; i < pm->descs_len; i++)
+    free (pm->descs[i].imports);
+  free (pm->descs);
+  ArenaFree (&pm->arena);
+  free (pm);
+}
+
+/* The compact layout of the exports and imports of a module: parallel
+ * arrays, with strings held as ids in the symbol table of the tree
+ */
+struct CompactTables
+{
+  struct SymbolTable *symbols;
+  WORD *export_ordinal;
+  DWORD *export_name;
+  DWORD *export_forward_str;
+  DWORD *export_address_offset;
+  int *export_section_index;
+  unsigned char *export_forward_state;
+  /* Where forwarders lead, once ResolveForwards () has followed them:
+   * index + 1 into the exports of export_forward_module
+   */
+  DWORD *export_forward;
+  struct DepTreeElement **export_forward_module;
+  uint64_t *import_orig_address;
+  /* NULL if every address is 0, as it is unless on_self */
+  uint64_t *import_address;
+  DWORD *import_name;
+  int *import_ordinal;
+  unsigned char *import_delayed;
+  struct DepTreeElement **import_dll;
+  /* index + 1 into the exports of import_dll, 0 if not bound */
+  DWORD *import_mapped;
+};
+
+static char *ExportName (struct DepTreeElement *dll, uint64_t j)
+{
+  if (dll->compact != NULL)
+    return SymbolString (dll->compact->symbols, dll->compact->export_name[j]);
+  return dll->exports[j].name;
+}
+
+static WORD ExportOrdinal (struct DepTreeElement *dll, uint64_t j)
+{
+  if (dll->compact != NULL)
+    return dll->compact->export_ordinal[j];
+  return dll->exports[j].ordinal;
+}
+
+static char *ExportForwardStr (struct DepTreeElement *dll, uint64_t j)
+{
+  if (dll->compact != NULL)
+    return SymbolString (dll->compact->symbols, dll->compact->export_forward_str[j]);
+  return dll->exports[j].forward_str;
+}
+
+static int ExportForwardState (struct DepTreeElement *dll, uint64_t j)
+{
+  if (dll->compact != NULL)
+    return dll->compact->export_forward_state[j];
+  return dll->exports[j].forward_state;
+}
+
+static void SetExportForwardState (struct DepTreeElement *dll, uint64_t j, int state)
+{
+  if (dll->compact != NULL)
+    dll->compact->export_forward_state[j] = (unsigned char) state;
+  else
+    dll->exports[j].forward_state = state;
+}
+
+struct ExportIndex
+{
+  /* dll->exports or dll->compact when the index was built */
+  void *tables;
+  /* Open-addressing hash of the interned export names, slots hold
+   * index + 1
+   */
+  DWORD names_size;
+  DWORD *names;
+  /* by_ordinal[ordinal - min_ordinal] is index + 1 of the first
+   * export with that ordinal
+   */
+  WORD min_ordinal;
+  DWORD ordinals_len;
+  DWORD *by_ordinal;
+};
+
+static DWORD HashSymbol (const char *name)
+{
+  return (DWORD) ((size_t) name >> 3) * 2654435761U;
+}
+
+static void *ExportTables (struct DepTreeElement *dll)
+{
+  return dll->compact != NULL ? (void *) dll->compact : (void *) dll->exports;
+}
+
+static struct ExportIndex *BuildExportIndex (struct DepTreeElement *dll)
+{
+  struct DepTreeElement *root = DepRoot (dll);
+  struct Arena *arena = DepArena (root);
+  struct SymbolTable *symbols = DepSymbols (root);
+  struct ExportIndex *index;
+  uint64_t j;
+  DWORD named = 0, slot;
+  WORD max_ordinal = 0;
+
+  if (arena == NULL || symbols == NULL)
+    return NULL;
+  /* A rebuilt index leaves the old one in the arena */
+  index = (struct ExportIndex *) ArenaAlloc (arena, sizeof (struct ExportIndex));
+  if (index == NULL)
+    return NULL;
+  index->tables = ExportTables (dll);
+
+  index->min_ordinal = 0xFFFF;
+  for (j = 0; j < dll->exports_len; j++)
+  {
+    WORD ordinal = ExportOrdinal (dll, j);
+    /* Compact names are interned already */
+    if (dll->compact == NULL && dll->exports[j].name != NULL)
+    {
+      DWORD id = InternSymbol (symbols, arena, dll->exports[j].name, 0);
+      if (id == 0)
+        return NULL;
+      dll->exports[j].name = SymbolString (symbols, id);
+    }
+    if (ExportName (dll, j) != NULL)
+      named++;
+    if (ordinal > 0)
+    {
+      if (ordinal < index->min_ordinal)
+        index->min_ordinal = ordinal;
+      if (ordinal > max_ordinal)
+        max_ordinal = ordinal;
+    }
+  }
+
+  for (index->names_size = 16; index->names_size < named * 2; index->names_size *= 2)
+    ;
+  index->names = (DWORD *) ArenaAlloc (arena, index->names_size * sizeof (DWORD));
+  if (index->names == NULL)
+    return NULL;
+  if (max_ordinal >= index->min_ordinal)
+  {
+    index->ordinals_len = max_ordinal - index->min_ordinal + 1;
+    index->by_ordinal = (DWORD *) ArenaAlloc (arena, index->ordinals_len * sizeof (DWORD));
+    if (index->by_ordinal == NULL)
+      return NULL;
+  }
+
+  /* Only the first export with a given name or ordinal is recorded,
+   * which is the one the linear scan used to stop at
+   */
+  for (j = 0; j < dll->exports_len; j++)
+  {
+    char *name = ExportName (dll, j);
+    WORD ordinal = ExportOrdinal (dll, j);
+    if (name != NULL)
+    {
+      for (slot = HashSymbol (name) & (index->names_size - 1); index->names[slot] != 0; slot = (slot + 1) & (index->names_size - 1))
+        if (ExportName (dll, index->names[slot] - 1) == name)
+          break;
+      if (index->names[slot] == 0)
+        index->names[slot] = (DWORD) j + 1;
+    }
+    if (ordinal > 0 && index->by_ordinal[ordinal - index->min_ordinal] == 0)
+      index->by_ordinal[ordinal - index->min_ordinal] = (DWORD) j + 1;
+  }
+  dll->export_index = index;
+  return index;
+}
+
+/* Returns NULL if there is no memory for the index */
+static struct ExportIndex *GetExportIndex (struct DepTreeElement *dll)
+{
+  /* exports are only filled in once the dll itself is processed */
+  if (dll->export_index == NULL || dll->export_index->tables != ExportTables (dll))
+    return BuildExportIndex (dll);
+  return dll->export_index;
+}
+
+/* Returns index + 1 of the first export of dll that matches either
+ * name, which has to be interned, or ordinal, or 0. Ordinals below 1
+ * and NULL names never match.
+ */
+static DWORD FindExport (struct DepTreeElement *dll, char *name, int ordinal)
+{
+  struct ExportIndex *index;
+  DWORD slot, by_name = 0, by_ordinal = 0;
+  uint64_t j;
+
+  if (dll->exports_len == 0)
+    return 0;
+  index = GetExportIndex (dll);
+  if (index == NULL)
+  {
+    /* Without memory for the index, the exports are scanned */
+    for (j = 0; j < dll->exports_len; j++)
+    {
+      char *export_name = ExportName (dll, j);
+      if ((name != NULL && export_name != NULL && strcmp (export_name, name) == 0) ||
+          (ordinal > 0 && ExportOrdinal (dll, j) == ordinal))
+        return (DWORD) j + 1;
+    }
+    return 0;
+  }
+
+  if (name != NULL)
+  {
+    for (slot = HashSymbol (name) & (index->names_size - 1); index->names[slot] != 0; slot = (slot + 1) & (index->names_size - 1))
+    {
+      if (ExportName (dll, index->names[slot] - 1) == name)
+      {
+        by_name = index->names[slot];
+        break;
+      }
+    }
+  }
+  if (ordinal > 0 && ordinal >= index->min_ordinal && (DWORD) (ordinal - index->min_ordinal) < index->ordinals_len)
+    by_ordinal = index->by_ordinal[ordinal - index->min_ordinal];
+
+  if (by_name != 0 && (by_ordinal == 0 || by_name < by_ordinal))
+    return by_name;
+  return by_ordinal;
+}
+
+BOOL TryMapAndLoad (ImageLoader *loader, PCSTR name, PCSTR path, PLOADED_IMAGE loadedImage, int requiredMachineType)
+{
+    BOOL success = loader->map_and_load (loader, name, path, loadedImage, FALSE);
+    if (!success && GetLastError () == ERROR_FILE_NOT_FOUND)
+        success = loader->map_and_load (loader, name, path, loadedImage, TRUE);
+    if (success && requiredMachineType != 0 && (int)loadedImage->FileHeader->FileHeader.Machine != requiredMachineType)
+    {
+        loader->unmap_and_load (loader, loadedImage);
+        return FALSE;
+    }
+    return success;
+}
+
+/* What a cache entry was made from: the file must still have the
+ * same size, modification time, TimeDateStamp and CheckSum
+ */
+struct ModuleStamp
+{
+  uint64_t size;
+  uint64_t mtime;
+  DWORD timestamp;
+  DWORD checksum;
+};
+
+struct ModuleCacheEntry
+{
+  char *path;
+  DWORD hash;
+  struct ModuleStamp stamp;
+  /* Without resolved_module and mapped_address, which depend on how
+   * the module was found and loaded. NULL while the module is still
+   * only in the cache file, as the length bytes at offset in data.
+   */
+  struct ParsedModule *module;
+  size_t offset;
+  size_t length;
+};
+
+struct ModuleCache
+{
+  NtlddMutex lock;
+  uint64_t size;
+  uint64_t len;
+  struct ModuleCacheEntry *entries;
+  /* The cache file as it was loaded. Modules are only decoded from
+   * it when they are asked for, so that a run that changed little
+   * costs little, and written back as they are.
+   */
+  unsigned char *data;
+  int dirty;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/* Where ProbeModuleCache () found a module */
+struct ModuleCacheProbe
+{
+  /* As map_and_load () would set ModuleName */
+  char found[MAX_PATH];
+  char key[MAX_PATH];
+  struct ModuleStamp stamp;
+};
+
+#define MODULE_CACHE_MAGIC "NTLDDMC3"
+
+/* Returns NULL if out of memory */
+static struct ParsedModule *CopyParsedModule (struct ParsedModule *from)
+{
+  struct ParsedModule *pm = (struct ParsedModule *) calloc (1, sizeof (struct ParsedModule));
+  uint64_t i, j;
+
+  if (pm == NULL)
+    return NULL;
+  pm->result = from->result;
+  pm->flags = from->flags;
+  pm->machineType = from->machineType;
+  pm->isPE32plus = from->isPE32plus;
+  pm->export_module = ArenaStrdup (&pm->arena, from->export_module);
+  if (from->export_module != NULL && pm->export_module == NULL)
+    goto Error;
+  if (from->exports_len > 0)
+  {
+    pm->exports = (struct ExportTableItem *) ArenaAlloc (&pm->arena, (size_t) from->exports_len * sizeof (struct ExportTableItem));
+    if (pm->exports == NULL)
+      goto Error;
+    pm->exports_len = from->exports_len;
+    for (i = 0; i < from->exports_len; i++)
+    {
+      pm->exports[i].ordinal = from->exports[i].ordinal;
+      pm->exports[i].name = ArenaStrdup (&pm->arena, from->exports[i].name);
+      pm->exports[i].forward_str = ArenaStrdup (&pm->arena, from->exports[i].forward_str);
+      pm->exports[i].section_index = from->exports[i].section_index;
+      pm->exports[i].address_offset = from->exports[i].address_offset;
+      if ((from->exports[i].name != NULL && pm->exports[i].name == NULL) ||
+          (from->exports[i].forward_str != NULL && pm->exports[i].forward_str == NULL))
+        goto Error;
+    }
+  }
+  if (from->descs_len > 0)
+  {
+    pm->descs = (struct ParsedImportDesc *) calloc ((size_t) from->descs_len, sizeof (struct ParsedImportDesc));
+    if (pm->descs == NULL)
+      goto Error;
+    pm->descs_size = from->descs_len;
+  }
+  for (i = 0; i < from->descs_len; i++)
+  {
+    struct ParsedImportDesc *d = &pm->descs[i], *f = &from->descs[i];
+    pm->descs_len = i + 1;
+    d->dll_name = ArenaStrdup (&pm->arena, f->dll_name);
+    if (f->dll_name != NULL && d->dll_name == NULL)
+      goto Error;
+    if (f->imports_len == 0)
+      continue;
+    d->imports = (struct ImportTableItem *) calloc ((size_t) f->imports_len, sizeof (struct ImportTableItem));
+    if (d->imports == NULL)
+      goto Error;
+    d->imports_len = d->imports_size = f->imports_len;
+    for (j = 0; j < f->imports_len; j++)
+    {
+      d->imports[j] = f->imports[j];
+      d->imports[j].name = ArenaStrdup (&pm->arena, f->imports[j].name);
+      if (f->imports[j].name != NULL && d->imports[j].name == NULL)
+        goto Error;
+    }
+  }
+  return pm;
+
+Error:
+  FreeParsedModule (pm);
+  return NULL;
+}
+
+static struct ModuleCacheEntry *ModuleCacheFind (struct ModuleCache *cache, const char *path, DWORD hash)
+{
+  uint64_t i;
+  if (cache->size == 0)
+    return NULL;
+  for (i = hash & (cache->size - 1); cache->entries[i].path != NULL; i = (i + 1) & (cache->size - 1))
+    if (cache->entries[i].hash == hash && strcmp (cache->entries[i].path, path) == 0)
+      return &cache->entries[i];
+  return NULL;
+}
+
+/* Takes over module, which is dropped if out of memory */
+static void ModuleCacheStore (struct ModuleCache *cache, const char *path, struct ModuleStamp *stamp, struct ParsedModule *module)
+{
+  DWORD hash = HashName (path);
+  struct ModuleCacheEntry *entry = ModuleCacheFind (cache, path, hash);
+  uint64_t i;
+
+  cache->dirty = 1;
+  if (entry != NULL)
+  {
+    FreeParsedModule (entry->module);
+    entry->stamp = *stamp;
+    entry->module = module;
+    entry->length = 0;
+    return;
+  }
+  if ((cache->len + 1) * 2 > cache->size)
+  {
+    struct ModuleCacheEntry *old = cache->entries;
+    uint64_t old_size = cache->size;
+    struct ModuleCacheEntry *entries = (struct ModuleCacheEntry *) calloc ((size_t) (old_size > 0 ? old_size * 2 : 256), sizeof (struct ModuleCacheEntry));
+    if (entries == NULL)
+    {
+      FreeParsedModule (module);
+      return;
+    }
+    cache->size = old_size > 0 ? old_size * 2 : 256;
+    cache->entries = entries;
+    for (i = 0; i < old_size; i++)
+    {
+      uint64_t j;
+      if (old[i].path == NULL)
+        continue;
+      for (j = old[i].hash & (cache->size - 1); cache->entries[j].path != NULL; j = (j + 1) & (cache->size - 1))
+        ;
+      cache->entries[j] = old[i];
+    }
+    free (old);
+  }
+  for (i = hash & (cache->size - 1); cache->entries[i].path != NULL; i = (i + 1) & (cache->size - 1))
+    ;
+  cache->entries[i].path = strdup (path);
+  if (cache->entries[i].path == NULL)
+  {
+    FreeParsedModule (module);
+    return;
+  }
+  cache->entries[i].hash = hash;
+  cache->entries[i].stamp = *stamp;
+  cache->entries[i].module = module;
+  cache->entries[i].length = 0;
+  cache->len += 1;
+}
+
+static BOOL ReadImageStamp (HANDLE h, uint64_t size, struct ModuleStamp *stamp)
+{
+  IMAGE_DOS_HEADER dos;
+  /* Signature, file header and optional header up to CheckSum, which
+   * is at the same offset in PE32 and PE32+ images
+   */
+  unsigned char nt[sizeof (DWORD) + sizeof (IMAGE_FILE_HEADER) + 68];
+  DWORD got;
+  stamp->size = size;
+  stamp->mtime = ImageFileMTime (h);
+  stamp->timestamp = 0;
+  stamp->checksum = 0;
+  if (!ReadImageFile (h, &dos, 0, sizeof (dos), &got) || got != sizeof (dos) ||
+      dos.e_magic != IMAGE_DOS_SIGNATURE || dos.e_lfanew < 0)
+    return FALSE;
+  if (!ReadImageFile (h, nt, (DWORD) dos.e_lfanew, sizeof (nt), &got) || got < 12)
+    return FALSE;
+  memcpy (&stamp->timestamp, &nt[8], sizeof (DWORD));
+  if (got == sizeof (nt))
+    memcpy (&stamp->checksum, &nt[sizeof (nt) - sizeof (DWORD)], sizeof (DWORD));
+  return TRUE;
+}
+
+static void PutU32 (FILE *f, DWORD v)
+{
+  unsigned char b[4];
+  b[0] = v & 0xFF; b[1] = (v >> 8) & 0xFF; b[2] = (v >> 16) & 0xFF; b[3] = (v >> 24) & 0xFF;
+  fwrite (b, 1, 4, f);
+}
+
+static void PutU64 (FILE *f, uint64_t v)
+{
+  PutU32 (f, (DWORD) (v & 0xFFFFFFFFU));
+  PutU32 (f, (DWORD) (v >> 32));
+}
+
+static void PutString (FILE *f, const char *s)
+{
+  if (s == NULL)
+  {
+    PutU32 (f, 0xFFFFFFFFU);
+    return;
+  }
+  PutU32 (f, (DWORD) strlen (s));
+  fwrite (s, 1, strlen (s), f);
+}
+
+struct CacheReader
+{
+  unsigned char *data;
+  size_t len;
+  size_t pos;
+  int bad;
+};
+
+static DWORD GetU32 (struct CacheReader *r)
+{
+  DWORD v;
+  if (r->bad || r->len - r->pos < 4)
+  {
+    r->bad = 1;
+    return 0;
+  }
+  v = r->data[r->pos] | (r->data[r->pos + 1] << 8) | (r->data[r->pos + 2] << 16) | ((DWORD) r->data[r->pos + 3] << 24);
+  r->pos += 4;
+  return v;
+}
+
+static uint64_t GetU64 (struct CacheReader *r)
+{
+  uint64_t lo = GetU32 (r);
+  return lo | ((uint64_t) GetU32 (r) << 32);
+}
+
+/* Allocates from arena, or with malloc () if it is NULL */
+static char *GetString (struct CacheReader *r, struct Arena *arena)
+{
+  DWORD len = GetU32 (r);
+  char *s;
+  if (r->bad || len == 0xFFFFFFFFU)
+    return NULL;
+  if (r->len - r->pos < len)
+  {
+    r->bad = 1;
+    return NULL;
+  }
+  s = arena != NULL ? (char *) ArenaBump (arena, len + 1, 1) : (char *) malloc (len + 1);
+  if (s == NULL)
+  {
+    r->bad = 1;
+    return NULL;
+  }
+  memcpy (s, &r->data[r->pos], len);
+  s[len] = '\0';
+  r->pos += len;
+  return s;
+}
+
+/* Element counts are checked against what is left of the file, each
+ * element takes at least min_size bytes
+ */
+static uint64_t GetCount (struct CacheReader *r, size_t min_size)
+{
+  uint64_t n = GetU64 (r);
+  if (!r->bad && n > (r->len - r->pos) / min_size)
+    r->bad = 1;
+  return r->bad ? 0 : n;
+}
+
+/* Sets r->bad if out of memory as well */
+static struct ParsedModule *GetParsedModule (struct CacheReader *r)
+{
+  struct ParsedModule *pm = (struct ParsedModule *) calloc (1, sizeof (struct ParsedModule));
+  uint64_t i, j;
+
+  if (pm == NULL)
+  {
+    r->bad = 1;
+    return NULL;
+  }
+  pm->machineType = (int) GetU32 (r);
+  pm->isPE32plus = (int) GetU32 (r);
+  pm->export_module = GetString (r, &pm->arena);
+  pm->exports_len = GetCount (r, 18);
+  if (pm->exports_len > 0)
+  {
+    pm->exports = (struct ExportTableItem *) ArenaAlloc (&pm->arena, (size_t) pm->exports_len * sizeof (struct ExportTableItem));
+    if (pm->exports == NULL)
+    {
+      r->bad = 1;
+      pm->exports_len = 0;
+    }
+  }
+  for (i = 0; i < pm->exports_len; i++)
+  {
+    pm->exports[i].ordinal = (WORD) GetU32 (r);
+    pm->exports[i].name = GetString (r, &pm->arena);
+    pm->exports[i].forward_str = GetString (r, &pm->arena);
+    pm->exports[i].section_index = (int) GetU32 (r);
+    pm->exports[i].address_offset = GetU32 (r);
+  }
+  pm->descs_len = pm->descs_size = GetCount (r, 12);
+  if (pm->descs_len > 0)
+  {
+    pm->descs = (struct ParsedImportDesc *) calloc ((size_t) pm->descs_len, sizeof (struct ParsedImportDesc));
+    if (pm->descs == NULL)
+    {
+      r->bad = 1;
+      pm->descs_len = pm->descs_size = 0;
+    }
+  }
+  for (i = 0; i < pm->descs_len; i++)
+  {
+    struct ParsedImportDesc *d = &pm->descs[i];
+    d->dll_name = GetString (r, &pm->arena);
+    d->imports_len = d->imports_size = GetCount (r, 28);
+    if (d->imports_len > 0)
+    {
+      d->imports = (struct ImportTableItem *) calloc ((size_t) d->imports_len, sizeof (struct ImportTableItem));
+      if (d->imports == NULL)
+      {
+        r->bad = 1;
+        d->imports_len = d->imports_size = 0;
+      }
+    }
+    for (j = 0; j < d->imports_len; j++)
+    {
+      d->imports[j].orig_address = GetU64 (r);
+      d->imports[j].address = GetU64 (r);
+      d->imports[j].name = GetString (r, &pm->arena);
+      d->imports[j].ordinal = (int) GetU32 (r);
+      d->imports[j].is_delayed = (int) GetU32 (r);
+    }
+  }
+  return pm;
+}
+
+/* Looks name up in path the way TryMapAndLoad () would. Returns -1 if
+ * TryMapAndLoad () would fail without loading anything new, 0 if the
+ * module has to be loaded (probe is then filled in, for
+ * ModuleCacheStore ()), and 1 if it was in the cache; *result is then
+ * a copy of the cached module.
+ */
+static int ProbeModuleCache (struct ModuleCache *cache, PCSTR name, PCSTR path, int machineType, struct ModuleCacheProbe *probe, struct ParsedModule **result)
+{
+  struct ModuleCacheEntry *entry;
+  uint64_t size;
+  BOOL stamped;
+  HANDLE h;
+
+  probe->key[0] = '\0';
+  *result = NULL;
+  h = OpenImageFile (name, path, FALSE, probe->found, &size);
+  if (h == INVALID_HANDLE_VALUE && GetLastError () == ERROR_FILE_NOT_FOUND)
+    h = OpenImageFile (name, path, TRUE, probe->found, &size);
+  if (h == INVALID_HANDLE_VALUE)
+    return -1;
+  stamped = ReadImageStamp (h, size, &probe->stamp);
+  CloseImageFile (h);
+  if (!stamped)
+    return 0;
+  FullImagePath (probe->found[0] != '\0' ? probe->found : name, probe->key);
+
+  MutexLock (&cache->lock);
+  entry = ModuleCacheFind (cache, probe->key, HashName (probe->key));
+  if (entry != NULL && (entry->stamp.size != probe->stamp.size || entry->stamp.mtime != probe->stamp.mtime ||
+      entry->stamp.timestamp != probe->stamp.timestamp || entry->stamp.checksum != probe->stamp.checksum))
+    entry = NULL;
+  if (entry != NULL && entry->module != NULL)
+    *result = CopyParsedModule (entry->module);
+  else if (entry != NULL)
+  {
+    /* The file data is never changed or freed before the cache is,
+     * so there is no need to hold the lock while decoding
+     */
+    struct CacheReader r;
+    memset (&r, 0, sizeof (r));
+    r.data = cache->data + entry->offset;
+    r.len = entry->length;
+    MutexUnlock (&cache->lock);
+    *result = GetParsedModule (&r);
+    if (r.bad)
+    {
+      FreeParsedModule (*result);
+      *result = NULL;
+    }
+    MutexLock (&cache->lock);
+  }
+  if (*result != NULL && machineType != 0 && (*result)->machineType != machineType)
+  {
+    MutexUnlock (&cache->lock);
+    FreeParsedModule (*result);
+    *result = NULL;
+    return -1;
+  }
+  if (*result != NULL)
+    cache->hits += 1;
+  else
+    cache->misses += 1;
+  MutexUnlock (&cache->lock);
+  return *result != NULL ? 1 : 0;
+}
+
+static void PutParsedModule (FILE *f, struct ParsedModule *pm)
+{
+  uint64_t i, j;
+
+  PutU32 (f, (DWORD) pm->machineType);
+  PutU32 (f, (DWORD) pm->isPE32plus);
+  PutString (f, pm->export_module);
+  PutU64 (f, pm->exports_len);
+  for (i = 0; i < pm->exports_len; i++)
+  {
+    PutU32 (f, pm->exports[i].ordinal);
+    PutString (f, pm->exports[i].name);
+    PutString (f, pm->exports[i].forward_str);
+    PutU32 (f, (DWORD) pm->exports[i].section_index);
+    PutU32 (f, pm->exports[i].address_offset);
+  }
+  PutU64 (f, pm->descs_len);
+  for (i = 0; i < pm->descs_len; i++)
+  {
+    struct ParsedImportDesc *d = &pm->descs[i];
+    PutString (f, d->dll_name);
+    PutU64 (f, d->imports_len);
+    for (j = 0; j < d->imports_len; j++)
+    {
+      PutU64 (f, d->imports[j].orig_address);
+      PutU64 (f, d->imports[j].address);
+      PutString (f, d->imports[j].name);
+      PutU32 (f, (DWORD) d->imports[j].ordinal);
+      PutU32 (f, (DWORD) d->imports[j].is_delayed);
+    }
+  }
+}
+
+struct ModuleCache *LoadModuleCache (const char *path)
+{
+  struct ModuleCache *cache = (struct ModuleCache *) calloc (1, sizeof (struct ModuleCache));
+  struct CacheReader r;
+  FILE *f;
+  long len;
+
+  if (cache == NULL)
+    return NULL;
+  MutexInit (&cache->lock);
+  f = path != NULL ? fopen (path, "rb") : NULL;
+  if (f == NULL)
+    return cache;
+  memset (&r, 0, sizeof (r));
+  if (fseek (f, 0, SEEK_END) == 0 && (len = ftell (f)) > 0 && fseek (f, 0, SEEK_SET) == 0)
+  {
+    r.len = (size_t) len;
+    r.data = (unsigned char *) malloc (r.len);
+    if (r.data == NULL || fread (r.data, 1, r.len, f) != r.len)
+      r.bad = 1;
+  }
+  else
+    r.bad = 1;
+  fclose (f);
+
+  if (r.bad || r.len < 8 || memcmp (r.data, MODULE_CACHE_MAGIC, 8) != 0)
+    r.bad = 1;
+  else
+  {
+    uint64_t i, n;
+    r.pos = 8;
+    n = GetCount (&r, 36);
+    for (i = 0; i < n && !r.bad; i++)
+    {
+      struct ModuleStamp stamp;
+      uint64_t length;
+      char *key = GetString (&r, NULL);
+      stamp.size = GetU64 (&r);
+      stamp.mtime = GetU64 (&r);
+      stamp.timestamp = GetU32 (&r);
+      stamp.checksum = GetU32 (&r);
+      length = GetU64 (&r);
+      if (!r.bad && (key == NULL || length > r.len - r.pos))
+        r.bad = 1;
+      if (!r.bad)
+      {
+        /* Decoded by ProbeModuleCache () once it is asked for */
+        struct ModuleCacheEntry *entry;
+        ModuleCacheStore (cache, key, &stamp, NULL);
+        entry = ModuleCacheFind (cache, key, HashName (key));
+        /* Out of memory, the cache is not worth keeping either */
+        if (entry == NULL)
+          r.bad = 1;
         else
         {
-          ith = (void *) idd[i].ImportAddressTableRVA;
-          oith = (void *) idd[i].ImportNameTableRVA;
+          entry->offset = r.pos;
+          entry->length = (size_t) length;
+          r.pos += (size_t) length;
         }
-        for (j = 0; (impaddress = thunk_data_u1_function (ith, j, self)) != 0; j++)
+      }
+      free (key);
+    }
+  }
+  if (r.bad)
+  {
+    /* Start over rather than trust any of it */
+    free (r.data);
+    FreeModuleCache (cache);
+    cache = (struct ModuleCache *) calloc (1, sizeof (struct ModuleCache));
+    if (cache == NULL)
+      return NULL;
+    MutexInit (&cache->lock);
+  }
+  else
+    cache->data = r.data;
+  cache->dirty = 0;
+  return cache;
+}
+
+int SaveModuleCache (struct ModuleCache *cache, const char *path)
+{
+  char *tmp;
+  FILE *f;
+  uint64_t i;
+  int ok;
+
+  if (!cache->dirty)
+    return 0;
+  /* Written to a file of its own and moved over the old one, so that
+   * concurrent runs never see half a file; the last one to finish wins
+   */
+  tmp = (char *) malloc (strlen (path) + 32);
+  if (tmp == NULL)
+    return -1;
+  f = CreateTempFile (path, tmp);
+  if (f == NULL)
+  {
+    free (tmp);
+    return -1;
+  }
+  fwrite (MODULE_CACHE_MAGIC, 1, 8, f);
+  PutU64 (f, cache->len);
+  for (i = 0; i < cache->size; i++)
+  {
+    struct ModuleCacheEntry *entry = &cache->entries[i];
+    if (entry->path == NULL)
+      continue;
+    PutString (f, entry->path);
+    PutU64 (f, entry->stamp.size);
+    PutU64 (f, entry->stamp.mtime);
+    PutU32 (f, entry->stamp.timestamp);
+    PutU32 (f, entry->stamp.checksum);
+    if (entry->module == NULL)
+    {
+      PutU64 (f, entry->length);
+      fwrite (cache->data + entry->offset, 1, entry->length, f);
+    }
+    else
+    {
+      /* The length goes in front, once it is known */
+      long start, end;
+      PutU64 (f, 0);
+      start = ftell (f);
+      PutParsedModule (f, entry->module);
+      end = ftell (f);
+      if (start < 0 || end < 0 || fseek (f, start - 8, SEEK_SET) != 0)
+        break;
+      PutU64 (f, (uint64_t) (end - start));
+      if (fseek (f, end, SEEK_SET) != 0)
+        break;
+    }
+  }
+  ok = i == cache->size;
+  ok = ok && !ferror (f);
+  ok = fclose (f) == 0 && ok;
+  ok = ok && RenameOver (tmp, path);
+  if (!ok)
+    remove (tmp);
+  else
+    cache->dirty = 0;
+  free (tmp);
+  return ok ? 0 : -1;
+}
+
+void FreeModuleCache (struct ModuleCache *cache)
+{
+  uint64_t i;
+  if (cache == NULL)
+    return;
+  for (i = 0; i < cache->size; i++)
+  {
+    free (cache->entries[i].path);
+    FreeParsedModule (cache->entries[i].module);
+  }
+  free (cache->entries);
+  free (cache->data);
+  MutexDestroy (&cache->lock);
+  free (cache);
+}
+
+void GetModuleCacheStats (struct ModuleCache *cache, uint64_t *hits, uint64_t *misses)
+{
+  *hits = cache->hits;
+  *misses = cache->misses;
+}
+
+/* Where each (name, machineType) was found among the search paths,
+ * shared by a whole run so that modules imported by many others, and
+ * especially missing ones, are only searched for once. Names compare
+ * without regard to case, as module names do on Windows.
+ */
+#define RESOLVE_MISSING -1
+
+struct ResolveEntry
+{
+  char *name;
+  int machineType;
+  DWORD hash;
+  /* Index into the search paths (count being the default search),
+   * or RESOLVE_MISSING
+   */
+  int found_at;
+};
+
+struct ResolveCache
+{
+  NtlddMutex lock;
+  uint64_t size;
+  uint64_t len;
+  struct ResolveEntry *entries;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct ResolveCache *NewResolveCache (void)
+{
+  struct ResolveCache *cache = (struct ResolveCache *) calloc (1, sizeof (struct ResolveCache));
+  if (cache == NULL)
+    return NULL;
+  MutexInit (&cache->lock);
+  return cache;
+}
+
+void FreeResolveCache (struct ResolveCache *cache)
+{
+  uint64_t i;
+  if (cache == NULL)
+    return;
+  for (i = 0; i < cache->size; i++)
+    free (cache->entries[i].name);
+  free (cache->entries);
+  MutexDestroy (&cache->lock);
+  free (cache);
+}
+
+void GetResolveCacheStats (struct ResolveCache *cache, uint64_t *hits, uint64_t *misses)
+{
+  *hits = cache->hits;
+  *misses = cache->misses;
+}
+
+static struct ResolveEntry *ResolveCacheFind (struct ResolveCache *cache, const char *name, int machineType, DWORD hash)
+{
+  uint64_t i;
+  if (cache->size == 0)
+    return NULL;
+  for (i = hash & (cache->size - 1); cache->entries[i].name != NULL; i = (i + 1) & (cache->size - 1))
+    if (cache->entries[i].hash == hash && cache->entries[i].machineType == machineType &&
+        stricmp (cache->entries[i].name, name) == 0)
+      return &cache->entries[i];
+  return NULL;
+}
+
+/* Returns the remembered search path index or RESOLVE_MISSING, or
+ * -2 if name has not been looked for yet
+ */
+static int LookupResolved (struct ResolveCache *cache, const char *name, int machineType)
+{
+  struct ResolveEntry *entry;
+  int found_at = -2;
+  MutexLock (&cache->lock);
+  entry = ResolveCacheFind (cache, name, machineType, HashNameI (name) ^ (DWORD) machineType);
+  if (entry != NULL)
+  {
+    found_at = entry->found_at;
+    cache->hits += 1;
+  }
+  else
+    cache->misses += 1;
+  MutexUnlock (&cache->lock);
+  return found_at;
+}
+
+static void RememberResolved (struct ResolveCache *cache, const char *name, int machineType, int found_at)
+{
+  DWORD hash = HashNameI (name) ^ (DWORD) machineType;
+  uint64_t i;
+
+  MutexLock (&cache->lock);
+  if (ResolveCacheFind (cache, name, machineType, hash) != NULL)
+  {
+    MutexUnlock (&cache->lock);
+    return;
+  }
+  if ((cache->len + 1) * 2 > cache->size)
+  {
+    struct ResolveEntry *old = cache->entries;
+    uint64_t old_size = cache->size;
+    struct ResolveEntry *entries = (struct ResolveEntry *) calloc ((size_t) (old_size > 0 ? old_size * 2 : 64), sizeof (struct ResolveEntry));
+    /* Out of memory, the search is simply not remembered */
+    if (entries == NULL)
+    {
+      MutexUnlock (&cache->lock);
+      return;
+    }
+    cache->size = old_size > 0 ? old_size * 2 : 64;
+    cache->entries = entries;
+    for (i = 0; i < old_size; i++)
+    {
+      uint64_t j;
+      if (old[i].name == NULL)
+        continue;
+      for (j = old[i].hash & (cache->size - 1); cache->entries[j].name != NULL; j = (j + 1) & (cache->size - 1))
+        ;
+      cache->entries[j] = old[i];
+    }
+    free (old);
+  }
+  for (i = hash & (cache->size - 1); cache->entries[i].name != NULL; i = (i + 1) & (cache->size - 1))
+    ;
+  cache->entries[i].name = strdup (name);
+  if (cache->entries[i].name != NULL)
+  {
+    cache->entries[i].machineType = machineType;
+    cache->entries[i].hash = hash;
+    cache->entries[i].found_at = found_at;
+    cache->len += 1;
+  }
+  MutexUnlock (&cache->lock);
+}
+
+/* API Set schema, flattened into a hash table keyed by lower-case
+ * name. Version 6 names are keyed without their last "-N" component,
+ * like the schema's own hash table, so that any minor version of a
+ * contract finds its host; older versions only match whole names.
+ */
+struct ApiSetHost
+{
+  /* NULL for the host of every other importer */
+  char *importer;
+  char *host;
+};
+
+struct ApiSetEntry
+{
+  char *key;
+  struct ApiSetHost *hosts;
+  DWORD hosts_len;
+};
+
+struct ApiSetSchema
+{
+  struct Arena arena;
+  uint64_t size;
+  uint64_t len;
+  struct ApiSetEntry *slots;
+};
+
+/* Reads what the schema blob data of size bytes holds at offset */
+static DWORD ApiSetU32 (const unsigned char *data, size_t size, uint64_t offset, int *ok)
+{
+  if (offset + 4 > size)
+  {
+    *ok = 0;
+    return 0;
+  }
+  return data[offset] | (data[offset + 1] << 8) | (data[offset + 2] << 16) | ((DWORD) data[offset + 3] << 24);
+}
+
+/* Copies the UTF-16 string of length bytes at offset, with prefix in
+ * front of it, and lower-cased if it is a key
+ */
+static char *ApiSetString (struct ApiSetSchema *schema, const unsigned char *data, size_t size, DWORD offset, DWORD length, const char *prefix, int key, int *ok)
+{
+  size_t prefix_len = strlen (prefix), i;
+  char *s;
+  if ((uint64_t) offset + length > size)
+  {
+    *ok = 0;
+    return NULL;
+  }
+  s = (char *) ArenaAlloc (&schema->arena, prefix_len + length / 2 + 1);
+  memcpy (s, prefix, prefix_len);
+  for (i = 0; i < length / 2; i++)
+  {
+    unsigned c = data[offset + i * 2] | (data[offset + i * 2 + 1] << 8);
+    if (key && c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    s[prefix_len + i] = c > 0 && c < 0x80 ? (char) c : '?';
+  }
+  return s;
+}
+
+static struct ApiSetEntry *ApiSetFind (struct ApiSetSchema *schema, const char *key)
+{
+  uint64_t i;
+  for (i = HashName (key) & (schema->size - 1); schema->slots[i].key != NULL; i = (i + 1) & (schema->size - 1))
+    if (strcmp (schema->slots[i].key, key) == 0)
+      return &schema->slots[i];
+  return &schema->slots[i];
+}
+
+/* Adds the hosts of one contract: count value entries of entry_size
+ * bytes at offset, each with the importer name and the host name at
+ * name_at and name_at + 8 within it. The first one that names no
+ * importer is the default.
+ */
+static void ApiSetAdd (struct ApiSetSchema *schema, const unsigned char *data, size_t size, char *key,
+    uint64_t offset, DWORD count, DWORD entry_size, DWORD name_at, int *ok)
+{
+  struct ApiSetEntry *entry = ApiSetFind (schema, key);
+  DWORD i;
+  /* The first contract with a given key wins */
+  if (entry->key != NULL || count > size / entry_size)
+    return;
+  entry->key = key;
+  entry->hosts = (struct ApiSetHost *) ArenaAlloc (&schema->arena, count * sizeof (struct ApiSetHost));
+  for (i = 0; i < count && *ok; i++)
+  {
+    uint64_t value = offset + (uint64_t) i * entry_size + name_at;
+    DWORD name_offset = ApiSetU32 (data, size, value, ok);
+    DWORD name_length = ApiSetU32 (data, size, value + 4, ok);
+    DWORD host_offset = ApiSetU32 (data, size, value + 8, ok);
+    DWORD host_length = ApiSetU32 (data, size, value + 12, ok);
+    struct ApiSetHost *host = &entry->hosts[entry->hosts_len];
+    if (!*ok)
+      break;
+    host->importer = name_length > 0 ? ApiSetString (schema, data, size, name_offset, name_length, "", 0, ok) : NULL;
+    host->host = ApiSetString (schema, data, size, host_offset, host_length, "", 0, ok);
+    /* The default host goes first */
+    if (host->importer == NULL && entry->hosts_len > 0 && entry->hosts[0].importer != NULL)
+    {
+      struct ApiSetHost first = entry->hosts[0];
+      entry->hosts[0] = *host;
+      *host = first;
+    }
+    entry->hosts_len++;
+  }
+  schema->len++;
+}
+
+struct ApiSetSchema *ParseApiSetSchema (const void *blob, size_t size)
+{
+  const unsigned char *data = (const unsigned char *) blob;
+  struct ApiSetSchema *schema;
+  DWORD version, count, i;
+  int ok = 1;
+
+  version = ApiSetU32 (data, size, 0, &ok);
+  if (!ok || (version != 2 && version != 4 && version != 6))
+    return NULL;
+  count = ApiSetU32 (data, size, version == 2 ? 4 : 12, &ok);
+  if (!ok || count > size / 12)
+    return NULL;
+  schema = (struct ApiSetSchema *) calloc (1, sizeof (struct ApiSetSchema));
+  for (schema->size = 16; schema->size < (uint64_t) count * 2; schema->size *= 2)
+    ;
+  schema->slots = (struct ApiSetEntry *) calloc ((size_t) schema->size, sizeof (struct ApiSetEntry));
+
+  for (i = 0; i < count && ok; i++)
+  {
+    if (version == 6)
+    {
+      /* Entries: flags, name, name length, hashed length, values,
+       * value count. Values: flags, importer, host.
+       */
+      uint64_t e = ApiSetU32 (data, size, 16, &ok) + (uint64_t) i * 24;
+      DWORD name_offset = ApiSetU32 (data, size, e + 4, &ok);
+      DWORD hashed_length = ApiSetU32 (data, size, e + 12, &ok);
+      DWORD values = ApiSetU32 (data, size, e + 16, &ok);
+      DWORD values_len = ApiSetU32 (data, size, e + 20, &ok);
+      char *key;
+      if (!ok)
+        break;
+      key = ApiSetString (schema, data, size, name_offset, hashed_length, "", 1, &ok);
+      if (ok)
+        ApiSetAdd (schema, data, size, key, values, values_len, 20, 4, &ok);
+    }
+    else
+    {
+      /* Version 4 entries: flags, name, name length, alias, alias
+       * length, values; values: flags, count, then flags, importer,
+       * host each. Version 2 entries: name, name length, values;
+       * values: count, then importer, host each. Names leave out
+       * "api-".
+       */
+      int v4 = version == 4;
+      uint64_t e = (v4 ? 16 : 8) + (uint64_t) i * (v4 ? 24 : 12);
+      DWORD name_offset = ApiSetU32 (data, size, e + (v4 ? 4 : 0), &ok);
+      DWORD name_length = ApiSetU32 (data, size, e + (v4 ? 8 : 4), &ok);
+      DWORD values = ApiSetU32 (data, size, e + (v4 ? 20 : 8), &ok);
+      DWORD values_len = ApiSetU32 (data, size, values + (v4 ? 4 : 0), &ok);
+      char *key;
+      if (!ok)
+        break;
+      key = ApiSetString (schema, data, size, name_offset, name_length, "", 1, &ok);
+      if (ok && strncmp (key, "ext-", 4) != 0)
+        key = ApiSetString (schema, data, size, name_offset, name_length, "api-", 1, &ok);
+      if (ok)
+        ApiSetAdd (schema, data, size, key, values + (v4 ? 8 : 4), values_len, v4 ? 20 : 16, v4 ? 4 : 0, &ok);
+    }
+  }
+  if (!ok)
+  {
+    FreeApiSetSchema (schema);
+    return NULL;
+  }
+  return schema;
+}
+
+struct ApiSetSchema *LoadApiSetSchema (const char *path)
+{
+  struct ApiSetSchema *schema = NULL;
+  unsigned char *data;
+  long size;
+  FILE *f = fopen (path, "rb");
+
+  if (f == NULL)
+    return NULL;
+  if (fseek (f, 0, SEEK_END) != 0 || (size = ftell (f)) <= 0 || fseek (f, 0, SEEK_SET) != 0)
+  {
+    fclose (f);
+    return NULL;
+  }
+  data = (unsigned char *) malloc (size);
+  if (data == NULL)
+  {
+    fclose (f);
+    return NULL;
+  }
+  if (fread (data, 1, size, f) != (size_t) size)
+    size = 0;
+  fclose (f);
+
+  if (size >= 2 && data[0] == 'M' && data[1] == 'Z')
+  {
+    /* apisetschema.dll: the schema is its .apiset section */
+    int ok = 1;
+    DWORD nt = ApiSetU32 (data, size, 0x3c, &ok);
+    DWORD sections = ApiSetU32 (data, size, (uint64_t) nt + 4, &ok) >> 16;
+    DWORD opt_size = ApiSetU32 (data, size, (uint64_t) nt + 20, &ok) & 0xffff;
+    uint64_t sec = (uint64_t) nt + 24 + opt_size;
+    DWORD i;
+    for (i = 0; ok && i < sections; i++, sec += 40)
+    {
+      DWORD raw_size = ApiSetU32 (data, size, sec + 16, &ok);
+      DWORD raw = ApiSetU32 (data, size, sec + 20, &ok);
+      DWORD virtual_size = ApiSetU32 (data, size, sec + 8, &ok);
+      if (ok && memcmp (&data[sec], ".apiset", 8) == 0)
+      {
+        if (virtual_size != 0 && virtual_size < raw_size)
+          raw_size = virtual_size;
+        if ((uint64_t) raw + raw_size <= (uint64_t) size)
+          schema = ParseApiSetSchema (&data[raw], raw_size);
+        break;
+      }
+    }
+  }
+  else if (size > 0)
+    schema = ParseApiSetSchema (data, size);
+  free (data);
+  return schema;
+}
+
+void FreeApiSetSchema (struct ApiSetSchema *schema)
+{
+  if (schema == NULL)
+    return;
+  ArenaFree (&schema->arena);
+  free (schema->slots);
+  free (schema);
+}
+
+const char *ResolveApiSet (struct ApiSetSchema *schema, const char *name, const char *importer)
+{
+  char key[MAX_PATH];
+  size_t len = strlen (name), i;
+  struct ApiSetEntry *entry;
+  const char *base;
+
+  if (len >= MAX_PATH || (strnicmp (name, "api-", 4) != 0 && strnicmp (name, "ext-", 4) != 0))
+    return NULL;
+  if (len > 4 && stricmp (&name[len - 4], ".dll") == 0)
+    len -= 4;
+  for (i = 0; i < len; i++)
+    key[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] + 'a' - 'A' : name[i];
+  key[len] = '\0';
+  entry = ApiSetFind (schema, key);
+  if (entry->key == NULL)
+  {
+    char *dash = strrchr (key, '-');
+    if (dash == NULL)
+      return NULL;
+    *dash = '\0';
+    entry = ApiSetFind (schema, key);
+    if (entry->key == NULL)
+      return NULL;
+  }
+  if (entry->hosts_len == 0)
+    return NULL;
+  if (importer != NULL)
+  {
+    for (base = importer + strlen (importer); base > importer && base[-1] != '/' && base[-1] != '\\'; base--)
+      ;
+    for (i = 0; i < entry->hosts_len; i++)
+      if (entry->hosts[i].importer != NULL && stricmp (entry->hosts[i].importer, base) == 0)
+        return entry->hosts[i].host[0] != '\0' ? entry->hosts[i].host : NULL;
+  }
+  return entry->hosts[0].host[0] != '\0' ? entry->hosts[0].host : NULL;
+}
+
+/* The module that dllname, imported by importer, is loaded from */
+static char *ImportedModuleName (BuildTreeConfig *cfg, char *dllname, const char *importer)
+{
+  const char *host;
+  if (cfg->apiset == NULL || dllname == NULL)
+    return dllname;
+  host = ResolveApiSet (cfg->apiset, dllname, importer);
+  return host != NULL ? (char *) host : dllname;
+}
+
+/* Loads name (searching for it like MapAndLoad () does) and parses it,
+ * or takes it from cfg->module_cache. Failures are recorded in the
+ * result, with result -1 if memory ran out; NULL is returned only if
+ * there was no memory for the result itself.
+ */
+static struct ParsedModule *ParseModule (BuildTreeConfig *cfg, ImageLoader *loader, char *name, int machineType)
+{
+  LOADED_IMAGE loaded_image;
+  LOADED_IMAGE *img;
+#ifdef _WIN32
+  IMAGE_DOS_HEADER *dos;
+  HMODULE hmod;
+#endif
+  BOOL success;
+  struct ParsedModule *pm;
+  struct ModuleCacheProbe probe;
+  struct ModuleCache *cache = cfg->module_cache;
+  SearchPaths *searchPaths = cfg->searchPaths;
+  int on_self = cfg->on_self;
+
+  DWORD i;
+  int soffs_len;
+  soff_entry *soffs;
+  soff_table soff_tab;
+  uint64_t started, t;
+
+  STATS_START (cfg, started);
+  pm = (struct ParsedModule *) calloc (1, sizeof (struct ParsedModule));
+  if (pm == NULL)
+    return NULL;
+  pm->result = 1;
+  memset(&loaded_image, 0, sizeof(LOADED_IMAGE));
+
+  if (on_self)
+  {
+#ifdef _WIN32
+    char modpath[MAX_PATH];
+    //success = GetModuleHandleExA (GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, name, &hmod);
+    hmod = GetModuleHandle(name);
+    success = !!hmod;
+    if (!success)
+      return pm;
+    if (GetModuleFileNameA (hmod, modpath, MAX_PATH) == 0)
+      return pm;
+    pm->resolved_module = ArenaStrdup (&pm->arena, modpath);
+    if (pm->resolved_module == NULL)
+    {
+      pm->result = -1;
+      return pm;
+    }
+
+    dos = (IMAGE_DOS_HEADER *) hmod;
+    loaded_image.FileHeader = (IMAGE_NT_HEADERS *) ((char *) hmod + dos->e_lfanew);
+    loaded_image.Sections = (IMAGE_SECTION_HEADER *) ((char *) hmod + dos->e_lfanew + sizeof (IMAGE_NT_HEADERS));
+    loaded_image.NumberOfSections = loaded_image.FileHeader->FileHeader.NumberOfSections;
+    loaded_image.MappedAddress = (void *) hmod;
+    if (machineType != 0 && (int)loaded_image.FileHeader->FileHeader.Machine != machineType)
+        return pm;
+#else
+    /* There is no loaded image of ourselves to look at */
+    return pm;
+#endif
+  }
+  else
+  {
+    /* The search path list ends with NULL, the default search */
+    int first = 0, last = (int) searchPaths->count, found_at = RESOLVE_MISSING;
+    if (cfg->resolved != NULL)
+    {
+      int remembered = LookupResolved (cfg->resolved, name, machineType);
+      if (remembered == RESOLVE_MISSING)
+      {
+        pm->flags = DEPTREE_UNRESOLVED;
+        return pm;
+      }
+      if (remembered >= 0)
+        first = last = remembered;
+    }
+    success = FALSE;
+    for (i = first; (int) i <= last && !success; ++i)
+    {
+      PCSTR path = i < searchPaths->count ? searchPaths->path[i] : NULL;
+      if (cache != NULL)
+      {
+        struct ParsedModule *cached = NULL;
+        int probed;
+        STATS_START (cfg, t);
+        probed = ProbeModuleCache (cache, name, path, machineType, &probe, &cached);
+        STATS_END (cfg, STATS_SEARCH, t);
+        if (probed < 0)
+          continue;
+        if (probed > 0)
         {
-          struct ImportTableItem *imp = AddImport (self);
-          imp->dll = dll;
-          imp->ordinal = -1;
-          imp->is_delayed = 1;
-          if (oith)
-            imp->orig_address = thunk_data_u1_function (oith, j, self);
-          if (cfg->on_self)
-          {
-            imp->address = impaddress;
-          }
-          if (oith && imp->orig_address & (1 << (sizeof (DWORD) * 8 - 1)))
-          {
-            imp->ordinal = imp->orig_address & ~(1 << (sizeof (DWORD) * 8 - 1));
-          }
-          else if (oith)
-          {
-            IMAGE_IMPORT_BY_NAME *byname = (IMAGE_IMPORT_BY_NAME *) MapPointer (soffs, soffs_len, (DWORD)imp->orig_address, NULL);
-            if (byname != NULL)
-              imp->name = strdup ((char *) byname->Name);
-          }
+          if (cfg->resolved != NULL)
+            RememberResolved (cfg->resolved, name, machineType, (int) i);
+          FreeParsedModule (pm);
+          cached->resolved_module = ArenaStrdup (&cached->arena, probe.found);
+          if (cached->resolved_module == NULL)
+            cached->result = -1;
+          return cached;
         }
       }
+      STATS_START (cfg, t);
+      success = TryMapAndLoad (loader, name, path, &loaded_image, machineType);
+      if (success)
+      {
+        STATS_END (cfg, STATS_MAP, t);
+        found_at = (int) i;
+      }
+      else
+        STATS_END (cfg, STATS_SEARCH, t);
+    }
+    if (cfg->resolved != NULL)
+      RememberResolved (cfg->resolved, name, machineType, found_at);
+    if (!success)
+    {
+      pm->flags = DEPTREE_UNRESOLVED;
+      return pm;
+    }
+    pm->resolved_module = ArenaStrdup (&pm->arena, loaded_image.ModuleName ? loaded_image.ModuleName : name);
+    if (pm->resolved_module == NULL)
+    {
+      pm->result = -1;
+      loader->unmap_and_load (loader, &loaded_image);
+      return pm;
+    }
+  }
+  pm->result = 0;
+  {
+    IMAGE_OPTIONAL_HEADER32 *OptionalHeader = (IMAGE_OPTIONAL_HEADER32 *)((char *)loaded_image.FileHeader + sizeof(IMAGE_FILE_HEADER) + sizeof(DWORD));
+    pm->machineType = (int)loaded_image.FileHeader->FileHeader.Machine;
+    pm->isPE32plus = OptionalHeader->Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+  }
+  img = &loaded_image;
+
+  /* Modules taken from a cache were never mapped, so with one no
+   * module gets an address and the output does not depend on what
+   * was cached
+   */
+  pm->mapped_address = cache == NULL ? loaded_image.MappedAddress : NULL;
+
+  STATS_START (cfg, t);
+  soffs_len = img->NumberOfSections;
+  soffs = (soff_entry *) malloc (sizeof(soff_entry) * (soffs_len + 1));
+  if (soffs == NULL)
+  {
+    pm->result = -1;
+    if (!on_self)
+      loader->unmap_and_load (loader, &loaded_image);
+    return pm;
+  }
+  for (i = 0; i < img->NumberOfSections; i++)
+  {
+    soffs[i].start = img->Sections[i].VirtualAddress;
+    soffs[i].end = soffs[i].start + (img->Sections[i].Misc.VirtualSize ? img->Sections[i].Misc.VirtualSize : img->Sections[i].SizeOfRawData);
+    if (on_self)
+      soffs[i].off = (char *) img->MappedAddress/* + img->Sections[i].VirtualAddress*/;
+    else if (img->Sections[i].PointerToRawData != 0)
+      soffs[i].off = (char *) img->MappedAddress + img->Sections[i].PointerToRawData - 
+          img->Sections[i].VirtualAddress;
+    else
+      soffs[i].off = NULL;
+  }
+  soffs[img->NumberOfSections].start = 0;
+  soffs[img->NumberOfSections].end = 0;
+  soffs[img->NumberOfSections].off = 0;
+
+  /* A module that could not be parsed fully is treated like one that
+   * could not be loaded, rather than analysed from what it lacks
+   */
+  if (BuildSoffTable (&soff_tab, soffs, soffs_len, img) < 0 ||
+      (!on_self && loader->load_range != NULL && LoadSectionsOnDemand (&soff_tab, loader, img) < 0) ||
+      ParseImage32or64 (img, on_self, pm, &soff_tab) < 0)
+    pm->result = -1;
+  FreeSoffTable (&soff_tab);
+  free (soffs);
+  STATS_END (cfg, STATS_PARSE, t);
+
+  if (cache != NULL && !on_self && probe.key[0] != '\0' && pm->result == 0)
+  {
+    struct ParsedModule *copy = CopyParsedModule (pm);
+    if (copy != NULL)
+    {
+      MutexLock (&cache->lock);
+      ModuleCacheStore (cache, probe.key, &probe.stamp, copy);
+      MutexUnlock (&cache->lock);
+    }
+  }
+
+  if (!on_self)
+  {
+    loader->unmap_and_load (loader, &loaded_image);
+    STATS_MODULE (cfg, pm->resolved_module[0] != '\0' ? pm->resolved_module : name, started);
+  }
+  return pm;
+}
+
+struct PrefetchTask
+{
+  char *name;
+  int machineType;
+};
+
+/* Each worker pops its own tasks from the tail of its deque, so it
+ * goes depth-first through what it discovers, and idle workers steal
+ * from the head of the others' deques
+ */
+struct PrefetchWorker
+{
+  struct ParsedCache *cache;
+  ImageLoader loader;
+  NtlddMutex lock;
+  struct PrefetchTask *tasks;
+  uint64_t tasks_size;
+  uint64_t head;
+  uint64_t tail;
+#ifdef _WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+};
+
+struct ParsedCacheEntry
+{
+  char *name;
+  int machineType;
+  DWORD hash;
+  /* NULL until parsed, and again once BuildDepTree () took it */
+  struct ParsedModule *module;
+};
+
+struct ParsedCache
+{
+  NtlddMutex lock;
+  uint64_t size;
+  uint64_t len;
+  struct ParsedCacheEntry *entries;
+  /* Tasks queued or being parsed, under lock */
+  uint64_t outstanding;
+  /* What ParseModule () needs of the caller's config */
+  BuildTreeConfig cfg;
+  struct PrefetchWorker *workers;
+  int workers_len;
+};
+
+static struct ParsedCacheEntry *ParsedCacheFind (struct ParsedCache *cache, char *name, int machineType, DWORD hash)
+{
+  uint64_t i;
+  if (cache->size == 0)
+    return NULL;
+  for (i = hash & (cache->size - 1); cache->entries[i].name != NULL; i = (i + 1) & (cache->size - 1))
+    if (cache->entries[i].hash == hash && cache->entries[i].machineType == machineType &&
+        strcmp (cache->entries[i].name, name) == 0)
+      return &cache->entries[i];
+  return NULL;
+}
+
+/* Adds (name, machineType) unless it is already there. Returns the
+ * new entry, or NULL if it was not added.
+ */
+static struct ParsedCacheEntry *ParsedCacheAdd (struct ParsedCache *cache, char *name, int machineType)
+{
+  DWORD hash = HashName (name) ^ (DWORD) machineType;
+  uint64_t i;
+  if (ParsedCacheFind (cache, name, machineType, hash) != NULL)
+    return NULL;
+  if ((cache->len + 1) * 2 > cache->size)
+  {
+    struct ParsedCacheEntry *old = cache->entries;
+    uint64_t old_size = cache->size;
+    struct ParsedCacheEntry *entries = (struct ParsedCacheEntry *) calloc ((size_t) (old_size > 0 ? old_size * 2 : 64), sizeof (struct ParsedCacheEntry));
+    if (entries == NULL)
+      return NULL;
+    cache->size = old_size > 0 ? old_size * 2 : 64;
+    cache->entries = entries;
+    for (i = 0; i < old_size; i++)
+    {
+      uint64_t j;
+      if (old[i].name == NULL)
+        continue;
+      for (j = old[i].hash & (cache->size - 1); cache->entries[j].name != NULL; j = (j + 1) & (cache->size - 1))
+        ;
+      cache->entries[j] = old[i];
+    }
+    free (old);
+  }
+  for (i = hash & (cache->size - 1); cache->entries[i].name != NULL; i = (i + 1) & (cache->size - 1))
+    ;
+  cache->entries[i].name = strdup (name);
+  if (cache->entries[i].name == NULL)
+    return NULL;
+  cache->entries[i].machineType = machineType;
+  cache->entries[i].hash = hash;
+  cache->entries[i].module = NULL;
+  cache->len += 1;
+  return &cache->entries[i];
+}
+
+/* Returns -1 if the task could not be queued; its module is then
+ * left for BuildDepTree () to parse
+ */
+static int PushTask (struct PrefetchWorker *w, char *name, int machineType)
+{
+  MutexLock (&w->lock);
+  if (w->tail >= w->tasks_size)
+  {
+    /* Slide the live tasks down before growing */
+    if (w->head > 0)
+    {
+      memmove (w->tasks, &w->tasks[w->head], (size_t) ((w->tail - w->head) * sizeof (struct PrefetchTask)));
+      w->tail -= w->head;
+      w->head = 0;
+    }
+    if (w->tail * 2 >= w->tasks_size &&
+        ResizeArray ((void **) &w->tasks, &w->tasks_size, sizeof (struct PrefetchTask)) != 0)
+    {
+      MutexUnlock (&w->lock);
+      return -1;
+    }
+  }
+  w->tasks[w->tail].name = name;
+  w->tasks[w->tail].machineType = machineType;
+  w->tail += 1;
+  MutexUnlock (&w->lock);
+  return 0;
+}
+
+static int PopTask (struct PrefetchWorker *w, struct PrefetchTask *task, int steal)
+{
+  int got = 0;
+  MutexLock (&w->lock);
+  if (w->head < w->tail)
+  {
+    if (steal)
+      *task = w->tasks[w->head++];
+    else
+      *task = w->tasks[--w->tail];
+    got = 1;
+  }
+  MutexUnlock (&w->lock);
+  return got;
+}
+
+static void RunPrefetchWorker (struct PrefetchWorker *w)
+{
+  struct ParsedCache *cache = w->cache;
+  struct PrefetchTask task;
+  struct ParsedModule *pm;
+  uint64_t i;
+  int k, self = (int) (w - cache->workers);
+
+  for (;;)
+  {
+    int got = PopTask (w, &task, 0);
+    for (k = 1; !got && k < cache->workers_len; k++)
+      got = PopTask (&cache->workers[(self + k) % cache->workers_len], &task, 1);
+    if (!got)
+    {
+      uint64_t outstanding;
+      MutexLock (&cache->lock);
+      outstanding = cache->outstanding;
+      MutexUnlock (&cache->lock);
+      if (outstanding == 0)
+        break;
+      YieldThread ();
+      continue;
+    }
+
+    pm = ParseModule (&cache->cfg, &w->loader, task.name, task.machineType);
+
+    MutexLock (&cache->lock);
+    ParsedCacheFind (cache, task.name, task.machineType, HashName (task.name) ^ (DWORD) task.machineType)->module = pm;
+    /* Children inherit the machine type, see ProcessDep () */
+    for (i = 0; pm != NULL && pm->result == 0 && i < pm->descs_len; i++)
+    {
+      struct ParsedCacheEntry *entry;
+      if (pm->descs[i].dll_name == NULL)
+        continue;
+      entry = ParsedCacheAdd (cache, ImportedModuleName (&cache->cfg, pm->descs[i].dll_name, task.name), pm->machineType);
+      if (entry != NULL && PushTask (w, entry->name, entry->machineType) == 0)
+        cache->outstanding += 1;
+    }
+    cache->outstanding -= 1;
+    MutexUnlock (&cache->lock);
+  }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI PrefetchThread (LPVOID arg)
+{
+  RunPrefetchWorker ((struct PrefetchWorker *) arg);
+  return 0;
+}
+#else
+static void *PrefetchThread (void *arg)
+{
+  RunPrefetchWorker ((struct PrefetchWorker *) arg);
+  return NULL;
+}
+#endif
+
+struct ParsedCache *PrefetchModules (BuildTreeConfig *cfg, char **names, int names_len, int threads)
+{
+  ImageLoader *loader = cfg->loader != NULL ? cfg->loader : GetImageLoader (NULL);
+  struct ParsedCache *cache;
+  int i, started;
+
+  if (threads < 1)
+    threads = 1;
+  cache = (struct ParsedCache *) calloc (1, sizeof (struct ParsedCache));
+  if (cache == NULL)
+    return NULL;
+  cache->workers = (struct PrefetchWorker *) calloc (threads, sizeof (struct PrefetchWorker));
+  if (cache->workers == NULL)
+  {
+    free (cache);
+    return NULL;
+  }
+  MutexInit (&cache->lock);
+  cache->cfg = *cfg;
+  cache->cfg.on_self = 0;
+  cache->cfg.prefetched = NULL;
+  cache->workers_len = threads;
+  for (i = 0; i < threads; i++)
+  {
+    struct PrefetchWorker *w = &cache->workers[i];
+    w->cache = cache;
+    w->loader = *loader;
+    w->loader.images_loaded = w->loader.bytes_mapped = w->loader.bytes_read = 0;
+    MutexInit (&w->lock);
+  }
+  /* Top-level modules start out with no machine type */
+  for (i = 0; i < names_len; i++)
+  {
+    struct ParsedCacheEntry *entry = ParsedCacheAdd (cache, names[i], 0);
+    if (entry != NULL && PushTask (&cache->workers[i % threads], entry->name, 0) == 0)
+      cache->outstanding += 1;
   }
 
-  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_IMPORT, self);
-  if (idata->Size > 0 && idata->VirtualAddress != 0)
+  for (started = 0; started < threads; started++)
   {
-    iid = (IMAGE_IMPORT_DESCRIPTOR *) MapPointer (soffs, soffs_len,
-        idata->VirtualAddress, NULL);
-    if (iid)
-      for (i = 0; iid[i].Characteristics || iid[i].TimeDateStamp ||
-          iid[i].ForwarderChain || iid[i].Name || iid[i].FirstThunk; i++)
-        ProcessDep (cfg, soffs, soffs_len, iid[i].Name, root, self, 1);
+#ifdef _WIN32
+    cache->workers[started].thread = CreateThread (NULL, 0, PrefetchThread, &cache->workers[started], 0, NULL);
+    if (cache->workers[started].thread == NULL)
+      break;
+#else
+    if (pthread_create (&cache->workers[started].thread, NULL, PrefetchThread, &cache->workers[started]) != 0)
+      break;
+#endif
+  }
+  /* Whatever could not be started is run here, the workers that did
+   * start will steal from it
+   */
+  if (started < threads)
+    RunPrefetchWorker (&cache->workers[started]);
+  for (i = 0; i < started; i++)
+  {
+#ifdef _WIN32
+    WaitForSingleObject (cache->workers[i].thread, INFINITE);
+    CloseHandle (cache->workers[i].thread);
+#else
+    pthread_join (cache->workers[i].thread, NULL);
+#endif
   }
 
-  idata = opt_header_get_dd_entry (opt_header, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT, self);
-  if (idata->Size > 0 && idata->VirtualAddress != 0)
+  for (i = 0; i < threads; i++)
   {
-    idd = (IMAGE_DELAYLOAD_DESCRIPTOR *) MapPointer (soffs, soffs_len, idata->VirtualAddress, NULL);
-    if (idd)
-      for (i = 0; idd[i].Attributes.AllAttributes || idd[i].DllNameRVA ||
-          idd[i].ModuleHandleRVA || idd[i].ImportAddressTableRVA || idd[i].ImportNameTableRVA ||
-          idd[i].BoundImportAddressTableRVA || idd[i].UnloadInformationTableRVA ||
-          idd[i].TimeDateStamp; i++)
-        ProcessDep (cfg, soffs, soffs_len, idd[i].DllNameRVA, root, self, 1);
+    struct PrefetchWorker *w = &cache->workers[i];
+    loader->images_loaded += w->loader.images_loaded;
+    loader->bytes_mapped += w->loader.bytes_mapped;
+    loader->bytes_read += w->loader.bytes_read;
+    MutexDestroy (&w->lock);
+    free (w->tasks);
   }
+  free (cache->workers);
+  cache->workers = NULL;
+  cache->workers_len = 0;
+  return cache;
 }
 
-BOOL TryMapAndLoad (PCSTR name, PCSTR path, PLOADED_IMAGE loadedImage, int requiredMachineType)
+void FreeParsedCache (struct ParsedCache *cache)
 {
-    BOOL success = MyMapAndLoad (name, path, loadedImage, FALSE, TRUE);
-    if (!success && GetLastError () == ERROR_FILE_NOT_FOUND)
-        success = MyMapAndLoad (name, path, loadedImage, TRUE, TRUE);
-    if (success && requiredMachineType != 0 && (int)loadedImage->FileHeader->FileHeader.Machine != requiredMachineType)
-    {
-        RosUnMapAndLoad (loadedImage);
-        return FALSE;
-    }
-    return success;
+  uint64_t i;
+  if (cache == NULL)
+    return;
+  for (i = 0; i < cache->size; i++)
+  {
+    free (cache->entries[i].name);
+    FreeParsedModule (cache->entries[i].module);
+  }
+  free (cache->entries);
+  MutexDestroy (&cache->lock);
+  free (cache);
 }
 
-int BuildDepTree (BuildTreeConfig* cfg, char *name, struct DepTreeElement *root, struct DepTreeElement *self)
+/* Returns the prefetched (name, machineType), if any. Successfully
+ * parsed modules are handed over and removed from the cache, failures
+ * stay there, since every importer of a missing module looks it up.
+ */
+static struct ParsedModule *TakePrefetched (struct ParsedCache *cache, char *name, int machineType, int *owned)
 {
-  LOADED_IMAGE loaded_image;
-  LOADED_IMAGE *img;
-  IMAGE_DOS_HEADER *dos;
-  HMODULE hmod;
-  BOOL success;
+  struct ParsedCacheEntry *entry = ParsedCacheFind (cache, name, machineType, HashName (name) ^ (DWORD) machineType);
+  struct ParsedModule *pm;
+  if (entry == NULL || entry->module == NULL)
+    return NULL;
+  pm = entry->module;
+  *owned = pm->result == 0;
+  if (*owned)
+    entry->module = NULL;
+  return pm;
+}
 
-  DWORD i, j;
-  int soffs_len;
-  soff_entry *soffs;
+/* Gives self the compact layout of the exports of pm, and of count
+ * imports: those self already has, then those of the descriptors
+ * whose module is in dlls. Nothing is kept from pm. Returns -1 if out
+ * of memory, leaving self as it was.
+ */
+static int CompactModule (struct Arena *arena, struct SymbolTable *symbols, struct ParsedModule *pm, struct DepTreeElement *self, struct DepTreeElement **dlls, uint64_t count)
+{
+  struct CompactTables *tables = (struct CompactTables *) ArenaAlloc (arena, sizeof (struct CompactTables));
+  uint64_t i, j, n = pm->exports_len, k = 0;
+  int addressed = 0;
 
-  if (self->flags & DEPTREE_PROCESSED)
+  if (tables == NULL)
+    return -1;
+  tables->symbols = symbols;
+  for (i = 0; i < self->imports_len; i++)
+    addressed |= self->imports[i].address != 0;
+  for (i = 0; i < pm->descs_len; i++)
+    for (j = 0; dlls[i] != NULL && j < pm->descs[i].imports_len; j++)
+      addressed |= pm->descs[i].imports[j].address != 0;
+
+  if (n > 0)
   {
-    return 0;
+    tables->export_ordinal = (WORD *) ArenaAlloc (arena, (size_t) (n * sizeof (WORD)));
+    tables->export_name = (DWORD *) ArenaAlloc (arena, (size_t) (n * sizeof (DWORD)));
+    tables->export_forward_str = (DWORD *) ArenaAlloc (arena, (size_t) (n * sizeof (DWORD)));
+    tables->export_address_offset = (DWORD *) ArenaAlloc (arena, (size_t) (n * sizeof (DWORD)));
+    tables->export_section_index = (int *) ArenaAlloc (arena, (size_t) (n * sizeof (int)));
+    tables->export_forward_state = (unsigned char *) ArenaAlloc (arena, (size_t) n);
+    if (tables->export_ordinal == NULL || tables->export_name == NULL || tables->export_forward_str == NULL ||
+        tables->export_address_offset == NULL || tables->export_section_index == NULL || tables->export_forward_state == NULL)
+      return -1;
   }
-
-  memset(&loaded_image, 0, sizeof(LOADED_IMAGE));
-
-  if (cfg->on_self)
+  for (i = 0; i < n; i++)
   {
-    char modpath[MAX_PATH];
-    //success = GetModuleHandleExA (GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, name, &hmod);
-    hmod = GetModuleHandle(name);
-    success = !!hmod;
-    if (!success)
-      return 1;
-    if (GetModuleFileNameA (hmod, modpath, MAX_PATH) == 0)
-      return 1;
-    if (self->resolved_module == NULL)
-      self->resolved_module = strdup (modpath);
+    struct ExportTableItem *exp = &pm->exports[i];
+    tables->export_ordinal[i] = exp->ordinal;
+    tables->export_name[i] = InternSymbol (symbols, arena, exp->name, 1);
+    tables->export_forward_str[i] = InternSymbol (symbols, arena, exp->forward_str, 1);
+    tables->export_address_offset[i] = exp->address_offset;
+    tables->export_section_index[i] = exp->section_index;
+    if ((exp->name != NULL && tables->export_name[i] == 0) || (exp->forward_str != NULL && tables->export_forward_str[i] == 0))
+      return -1;
+  }
 
-    dos = (IMAGE_DOS_HEADER *) hmod;
-    loaded_image.FileHeader = (IMAGE_NT_HEADERS *) ((char *) hmod + dos->e_lfanew);
-    loaded_image.Sections = (IMAGE_SECTION_HEADER *) ((char *) hmod + dos->e_lfanew + sizeof (IMAGE_NT_HEADERS));
-    loaded_image.NumberOfSections = loaded_image.FileHeader->FileHeader.NumberOfSections;
-    loaded_image.MappedAddress = (void *) hmod;
-    if (self->machineType != 0 && (int)loaded_image.FileHeader->FileHeader.Machine != self->machineType)
-        return 1;
+  if (count > 0)
+  {
+    tables->import_orig_address = (uint64_t *) ArenaAlloc (arena, (size_t) (count * sizeof (uint64_t)));
+    if (addressed)
+      tables->import_address = (uint64_t *) ArenaAlloc (arena, (size_t) (count * sizeof (uint64_t)));
+    tables->import_name = (DWORD *) ArenaAlloc (arena, (size_t) (count * sizeof (DWORD)));
+    tables->import_ordinal = (int *) ArenaAlloc (arena, (size_t) (count * sizeof (int)));
+    tables->import_delayed = (unsigned char *) ArenaAlloc (arena, (size_t) count);
+    tables->import_dll = (struct DepTreeElement **) ArenaAlloc (arena, (size_t) (count * sizeof (struct DepTreeElement *)));
+    tables->import_mapped = (DWORD *) ArenaAlloc (arena, (size_t) (count * sizeof (DWORD)));
+    if (tables->import_orig_address == NULL || (addressed && tables->import_address == NULL) || tables->import_name == NULL ||
+        tables->import_ordinal == NULL || tables->import_delayed == NULL || tables->import_dll == NULL || tables->import_mapped == NULL)
+      return -1;
   }
-  else
+  for (i = 0; i < pm->descs_len + 1; i++)
   {
-    success = FALSE;
-    for (i = 0; i < cfg->searchPaths->count && !success; ++i)
-    {
-      success = TryMapAndLoad (name, cfg->searchPaths->path[i], &loaded_image, self->machineType);
-    }
-    if (!success)
-        success = TryMapAndLoad (name, NULL, &loaded_image, self->machineType);
-    if (!success)
+    /* What self already had comes first, as it does in self->imports */
+    struct ImportTableItem *imps = i == 0 ? self->imports : pm->descs[i - 1].imports;
+    uint64_t imps_len = i == 0 ? self->imports_len : dlls[i - 1] != NULL ? pm->descs[i - 1].imports_len : 0;
+    for (j = 0; j < imps_len; j++, k++)
     {
-      self->flags |= DEPTREE_UNRESOLVED;
-      return 1;
+      tables->import_orig_address[k] = imps[j].orig_address;
+      if (addressed)
+        tables->import_address[k] = imps[j].address;
+      tables->import_name[k] = InternSymbol (symbols, arena, imps[j].name, 1);
+      if (imps[j].name != NULL && tables->import_name[k] == 0)
+        return -1;
+      tables->import_ordinal[k] = imps[j].ordinal;
+      tables->import_delayed[k] = (unsigned char) imps[j].is_delayed;
+      tables->import_dll[k] = i == 0 ? imps[j].dll : dlls[i - 1];
     }
+  }
+
+  self->compact = tables;
+  self->exports = NULL;
+  self->exports_len = n;
+  self->imports = NULL;
+  self->imports_len = self->imports_size = count;
+  return 0;
+}
+
+/* Fills self in from pm and recurses into its dependencies. Takes
+ * over pm's exports and import names; pm is still to be freed.
+ */
+static int LinkModule (BuildTreeConfig* cfg, struct ParsedModule *pm, char *name, struct DepTreeElement *root, struct DepTreeElement *self)
+{
+  struct Arena *arena = DepArena (root);
+  struct SymbolTable *symbols = DepSymbols (root);
+  struct DepTreeElement **dlls;
+  struct ImportTableItem *imports;
+  uint64_t i, j, count, t;
+
+  if (arena == NULL || symbols == NULL)
+    return -1;
+  if (pm->resolved_module != NULL && self->resolved_module == NULL)
+  {
+    self->resolved_module = ArenaStrdup (arena, pm->resolved_module);
     if (self->resolved_module == NULL)
-      self->resolved_module = strdup (loaded_image.ModuleName ? loaded_image.ModuleName : name);
+      return -1;
   }
+  if (pm->result != 0)
   {
-    IMAGE_OPTIONAL_HEADER32 *OptionalHeader = (IMAGE_OPTIONAL_HEADER32 *)((char *)loaded_image.FileHeader + sizeof(IMAGE_FILE_HEADER) + sizeof(DWORD));
-    self->machineType = (int)loaded_image.FileHeader->FileHeader.Machine;
-    self->isPE32plus = OptionalHeader->Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+    self->flags |= pm->flags;
+    return pm->result;
   }
-  img = &loaded_image;
+  self->machineType = pm->machineType;
+  self->isPE32plus = pm->isPE32plus;
 
-  PushStack (cfg->stack, cfg->stack_len, cfg->stack_size, name);
+  dlls = (struct DepTreeElement **) malloc (sizeof (struct DepTreeElement *) * (pm->descs_len + 1));
+  if (dlls == NULL)
+    return -1;
 
-  self->mapped_address = loaded_image.MappedAddress;
+  /* API Set contracts are imported from their host directly */
+  for (i = 0; i < pm->descs_len; i++)
+    pm->descs[i].dll_name = ImportedModuleName (cfg, pm->descs[i].dll_name, name);
 
-  self->flags |= DEPTREE_PROCESSED;
-
-  soffs_len = img->NumberOfSections;
-  soffs = (soff_entry *) malloc (sizeof(soff_entry) * (soffs_len + 1));
-  for (i = 0; i < img->NumberOfSections; i++)
+  if (PushStack (cfg->stack, name) != 0)
   {
-    soffs[i].start = img->Sections[i].VirtualAddress;
-    soffs[i].end = soffs[i].start + (img->Sections[i].Misc.VirtualSize ? img->Sections[i].Misc.VirtualSize : img->Sections[i].SizeOfRawData);
-    if (cfg->on_self)
-      soffs[i].off = img->MappedAddress/* + img->Sections[i].VirtualAddress*/;
-    else if (img->Sections[i].PointerToRawData != 0)
-      soffs[i].off = img->MappedAddress + img->Sections[i].PointerToRawData - 
-          img->Sections[i].VirtualAddress;
-    else
-      soffs[i].off = NULL;
+    free (dlls);
+    return -1;
   }
-  soffs[img->NumberOfSections].start = 0;
-  soffs[img->NumberOfSections].end = 0;
-  soffs[img->NumberOfSections].off = 0;
 
-  BuildDepTree32or64 (img, cfg, root, self, soffs, soffs_len);
-  free (soffs);
+  self->mapped_address = pm->mapped_address;
 
-  if (!cfg->on_self)
-    RosUnMapAndLoad (&loaded_image);
+  self->flags |= DEPTREE_PROCESSED;
 
-  /* Not sure if a forwarded export warrants an import. If it doesn't, then the dll to which the export is forwarded will NOT
-   * be among the dependencies of this dll and it will be necessary to do yet another ProcessDep...
-  for (i = 0; i < self->exports_len; i++)
+  count = self->imports_len;
+  for (i = 0; i < pm->descs_len; i++)
   {
-    if (self->exports[i]->forward_str != NULL && self-.exports[i]->forward == NULL)
+    dlls[i] = ProcessDep (cfg, pm->descs[i].dll_name, root, self);
+    if (dlls[i] != NULL)
+      count += pm->descs[i].imports_len;
+  }
+  if (cfg->compact)
+  {
+    if (self->export_module == NULL)
+      self->export_module = ArenaStrdup (arena, pm->export_module);
+    if ((pm->export_module != NULL && self->export_module == NULL) ||
+        CompactModule (arena, symbols, pm, self, dlls, count) != 0)
+    {
+      free (dlls);
+      return -1;
+    }
+  }
+  else
+  {
+    /* Export and import names stay where they are; the first copy
+     * of each import name stands for all of them, export names are
+     * interned by BuildExportIndex ()
+     */
+    ArenaAdopt (arena, &pm->arena);
+    /* Imports from AddImport () may point anywhere */
+    for (i = 0; i < self->imports_len; i++)
     {
-      char *forward_str_copy = NULL, *export_name = NULL, *rdot = NULL;
-      DWORD export_ordinal = 0;
-      forward_str_copy = strdup (self->exports[i]->forward_str);
-      rdot = strrchr (forward_str_copy, '.');
-      if (rdot != NULL && rdot[1] != 0)
+      char *imp_name = self->imports[i].name;
+      self->imports[i].name = SymbolString (symbols, InternSymbol (symbols, arena, imp_name, 1));
+      if (imp_name != NULL && self->imports[i].name == NULL)
       {
-        rdot[0] = 0;
-        export_name = &rdot[1];
-        if (export_name[0] == '#' && export_name[1] >= '0' && export_name[1] <= '9')
-        {
-          export_ordinal = strtol (&export_name[1], NULL, 10);
-          export_name = NULL;
-        }
-        self->exports[i]->forward = FindExportForward (forward_str_copy, export_name, export_ordinal);
+        free (dlls);
+        return -1;
       }
-      free (forward_str_copy);
+    }
+    if (self->export_module == NULL)
+      self->export_module = pm->export_module;
+    if (pm->exports_len > 0)
+    {
+      self->exports_len = pm->exports_len;
+      self->exports = pm->exports;
     }
   }
-  */
-  for (i = 0; i < self->imports_len; i++)
+  if (self->compact == NULL && count > self->imports_len)
   {
-    if (self->imports[i].mapped == NULL && self->imports[i].dll != NULL && (self->imports[i].name != NULL || self->imports[i].ordinal > 0))
+    imports = (struct ImportTableItem *) ArenaAlloc (arena, (size_t) (count * sizeof (struct ImportTableItem)));
+    if (imports == NULL)
+    {
+      free (dlls);
+      return -1;
+    }
+    if (self->imports_len > 0)
+      memcpy (imports, self->imports, (size_t) (self->imports_len * sizeof (struct ImportTableItem)));
+    self->imports = imports;
+    self->imports_size = count;
+    for (i = 0; i < pm->descs_len; i++)
     {
-      struct DepTreeElement *dll = self->imports[i].dll;
-      for (j = 0; j < dll->exports_len; j++)
+      if (dlls[i] == NULL)
+        continue;
+      for (j = 0; j < pm->descs[i].imports_len; j++)
       {
-        if ((self->imports[i].name != NULL && dll->exports[j].name != NULL && strcmp (self->imports[i].name, dll->exports[j].name) == 0) ||
-            (self->imports[i].ordinal > 0 && dll->exports[j].ordinal > 0 && self->imports[i].ordinal == dll->exports[j].ordinal))
+        struct ImportTableItem *imp = &self->imports[self->imports_len++];
+        *imp = pm->descs[i].imports[j];
+        imp->name = SymbolString (symbols, InternSymbol (symbols, arena, imp->name, 0));
+        imp->dll = dlls[i];
+        if (pm->descs[i].imports[j].name != NULL && imp->name == NULL)
         {
-          self->imports[i].mapped = &dll->exports[j];
-          break;
+          free (dlls);
+          return -1;
         }
       }
+    }
+  }
+
+  /* ProcessDep () skips modules that are already on the stack, but
+   * they are still dependencies of this one
+   */
+  self->deps = (struct DepTreeElement **) ArenaAlloc (arena, sizeof (struct DepTreeElement *) * (pm->descs_len + 1));
+  if (self->deps == NULL)
+  {
+    free (dlls);
+    return -1;
+  }
+  for (i = 0; i < pm->descs_len; i++)
+  {
+    struct DepTreeElement *dep = dlls[i];
+    if (dep == NULL && pm->descs[i].dll_name != NULL)
+    {
+      STATS_START (cfg, t);
+      FindDep (root, pm->descs[i].dll_name, self->machineType, &dep);
+      STATS_END (cfg, STATS_FINDDEP, t);
+    }
+    for (j = 0; dep != NULL && j < self->deps_len; j++)
+      if (self->deps[j] == dep)
+        dep = NULL;
+    if (dep != NULL)
+      self->deps[self->deps_len++] = dep;
+  }
+
+  /* All children are recorded before any is descended into, which
+   * keeps them ahead of their own dependencies in the output. Earlier
+   * children may have processed later ones by the time they are
+   * reached, as the stack then tells.
+   */
+  for (i = 0; i < pm->descs_len; i++)
+    if (dlls[i] != NULL && !StackContains (cfg->stack, pm->descs[i].dll_name))
+      BuildDepTree (cfg, pm->descs[i].dll_name, root, dlls[i]);
+  free (dlls);
+
+  STATS_START (cfg, t);
+  if (self->compact != NULL)
+  {
+    struct CompactTables *tables = self->compact;
+    for (i = 0; i < self->imports_len; i++)
+    {
+      char *imp_name = SymbolString (tables->symbols, tables->import_name[i]);
+      if (tables->import_mapped[i] == 0 && tables->import_dll[i] != NULL && (imp_name != NULL || tables->import_ordinal[i] > 0))
+        tables->import_mapped[i] = FindExport (tables->import_dll[i], imp_name, tables->import_ordinal[i]);
+    }
+  }
+  for (i = 0; self->compact == NULL && i < self->imports_len; i++)
+  {
+    if (self->imports[i].mapped == NULL && self->imports[i].dll != NULL && (self->imports[i].name != NULL || self->imports[i].ordinal > 0))
+    {
+      DWORD mapped = FindExport (self->imports[i].dll, self->imports[i].name, self->imports[i].ordinal);
+      if (mapped != 0)
+        self->imports[i].mapped = &self->imports[i].dll->exports[mapped - 1];
 /*
       if (self->imports[i].mapped == NULL)
-        printf ("Could not match %s (%d) in %s to %s\n", self->imports[i].name, self->imports[i].ordinal, self->module, dll->module);
+        printf ("Could not match %s (%d) in %s to %s\n", self->imports[i].name, self->imports[i].ordinal, self->module, self->imports[i].dll->module);
 */
     }
   }
+  STATS_END_N (cfg, STATS_BIND, t, self->imports_len);
   /* By keeping items in the stack we turn it into a list of all
    * processed modules, this should be more effective at preventing
    * us from processing modules multiple times
    */
-  /*PopStack (stack, stack_len, stack_size, name);*/
   return 0;
 }
+
+int BuildDepTree (BuildTreeConfig* cfg, char *name, struct DepTreeElement *root, struct DepTreeElement *self)
+{
+  ImageLoader *loader = cfg->loader != NULL ? cfg->loader : GetImageLoader (NULL);
+  struct ParsedModule *pm = NULL;
+  int owned = 1, result;
+
+  if (self->flags & DEPTREE_PROCESSED)
+  {
+    return 0;
+  }
+
+  if (cfg->prefetched != NULL && !cfg->on_self)
+    pm = TakePrefetched (cfg->prefetched, name, self->machineType, &owned);
+  if (pm == NULL)
+    pm = ParseModule (cfg, loader, name, self->machineType);
+  result = pm != NULL ? LinkModule (cfg, pm, name, root, self) : -1;
+  if (owned)
+    FreeParsedModule (pm);
+  if (result < 0)
+    cfg->out_of_memory = 1;
+  return result;
+}
+
+/* Returns -1 if out of memory */
+static int SetExportForward (struct DepTreeElement *dll, uint64_t j, struct DepTreeElement *module, DWORD export_index)
+{
+  struct CompactTables *tables = dll->compact;
+  if (tables == NULL)
+  {
+    dll->exports[j].forward = &module->exports[export_index - 1];
+    dll->exports[j].forward_module = module;
+    dll->exports[j].forward_state = FORWARD_DONE;
+    return 0;
+  }
+  /* Only modules with forwarders that lead somewhere need these */
+  if (tables->export_forward_module == NULL)
+  {
+    struct Arena *arena = DepArena (DepRoot (dll));
+    if (tables->export_forward == NULL)
+      tables->export_forward = (DWORD *) ArenaAlloc (arena, (size_t) (dll->exports_len * sizeof (DWORD)));
+    if (tables->export_forward == NULL)
+      return -1;
+    tables->export_forward_module = (struct DepTreeElement **) ArenaAlloc (arena, (size_t) (dll->exports_len * sizeof (struct DepTreeElement *)));
+    if (tables->export_forward_module == NULL)
+      return -1;
+  }
+  tables->export_forward[j] = export_index;
+  tables->export_forward_module[j] = module;
+  tables->export_forward_state[j] = FORWARD_DONE;
+  return 0;
+}
+
+/* Returns index + 1 of the export that export j of dll forwards to in
+ * the end, and sets *found_in to the module that has it, or returns 0
+ * if the chain is broken
+ */
+static DWORD ResolveForward (BuildTreeConfig *cfg, struct DepTreeElement *root, struct DepTreeElement *dll, uint64_t j, struct DepTreeElement **found_in)
+{
+  char module[MAX_PATH];
+  char *dot, *name, *forward_str, *host;
+  int ordinal = 0, found, state = ExportForwardState (dll, j);
+  size_t len;
+  struct DepTreeElement *target = NULL;
+  DWORD next;
+
+  if (state == FORWARD_DONE && dll->compact != NULL)
+  {
+    *found_in = dll->compact->export_forward_module[j];
+    return dll->compact->export_forward[j];
+  }
+  if (state == FORWARD_DONE)
+  {
+    *found_in = dll->exports[j].forward_module;
+    return (DWORD) (dll->exports[j].forward - (*found_in)->exports) + 1;
+  }
+  if (state != FORWARD_NONE)
+    return 0;
+  SetExportForwardState (dll, j, FORWARD_BROKEN);
+  forward_str = ExportForwardStr (dll, j);
+  dot = strrchr (forward_str, '.');
+  if (dot == NULL || dot[1] == '\0')
+    return 0;
+  /* The loader adds the extension, it is never part of the forward */
+  len = dot - forward_str;
+  if (len + 5 > MAX_PATH)
+    return 0;
+  memcpy (module, forward_str, len);
+  strcpy (&module[len], ".dll");
+  name = &dot[1];
+  if (name[0] == '#' && name[1] >= '0' && name[1] <= '9')
+  {
+    ordinal = strtol (&name[1], NULL, 10);
+    name = NULL;
+  }
+
+  /* Forwards into API Set contracts lead to their host, as imports do */
+  host = ImportedModuleName (cfg, module, dll->module);
+  found = FindDep (root, host, dll->machineType, &target);
+  if (found < 0)
+  {
+    target = NewDep (root, host);
+    if (target == NULL)
+      return 0;
+    target->machineType = dll->machineType;
+    if (AddDep (root, target) != 0)
+      return 0;
+  }
+  BuildDepTree (cfg, host, root, target);
+  if (target->flags & DEPTREE_UNRESOLVED)
+    return 0;
+
+  /* Indexing the exports interns their names, and no export has a
+   * name that was never interned
+   */
+  if (name != NULL && target->exports_len > 0 && GetExportIndex (target) == NULL)
+  {
+    cfg->out_of_memory = 1;
+    return 0;
+  }
+  if (name != NULL && (name = SymbolString (root->symbols, FindSymbol (root->symbols, name))) == NULL)
+    return 0;
+  next = FindExport (target, name, ordinal);
+  if (next == 0)
+    return 0;
+  SetExportForwardState (dll, j, FORWARD_PENDING);
+  if (ExportForwardStr (target, next - 1) != NULL)
+  {
+    struct DepTreeElement *last_in;
+    DWORD last = ResolveForward (cfg, root, target, next - 1, &last_in);
+    if (last == 0)
+    {
+      SetExportForwardState (dll, j, FORWARD_BROKEN);
+      return 0;
+    }
+    target = last_in;
+    next = last;
+  }
+  if (SetExportForward (dll, j, target, next) < 0)
+  {
+    SetExportForwardState (dll, j, FORWARD_BROKEN);
+    cfg->out_of_memory = 1;
+    return 0;
+  }
+  *found_in = target;
+  return next;
+}
+
+static void ResolveImportForwards (BuildTreeConfig *cfg, struct DepTreeElement *root, struct DepTreeElement *self)
+{
+  uint64_t i;
+  if (self->flags & DEPTREE_VISITED)
+    return;
+  self->flags |= DEPTREE_VISITED;
+  for (i = 0; i < self->imports_len; i++)
+  {
+    struct DepTreeElement *dll, *found_in;
+    DWORD mapped;
+    if (self->compact != NULL)
+    {
+      dll = self->compact->import_dll[i];
+      mapped = self->compact->import_mapped[i];
+    }
+    else
+    {
+      dll = self->imports[i].dll;
+      mapped = self->imports[i].mapped != NULL ? (DWORD) (self->imports[i].mapped - dll->exports) + 1 : 0;
+    }
+    if (mapped != 0 && ExportForwardStr (dll, mapped - 1) != NULL)
+      ResolveForward (cfg, root, dll, mapped - 1, &found_in);
+  }
+  for (i = 0; i < self->childs_len; i++)
+    ResolveImportForwards (cfg, root, self->childs[i]);
+}
+
+void ResolveForwards (BuildTreeConfig *cfg, struct DepTreeElement *root)
+{
+  uint64_t i;
+  /* Modules loaded for forwards are added to root as this goes, and
+   * are walked too
+   */
+  for (i = 0; i < root->childs_len; i++)
+    ResolveImportForwards (cfg, root, root->childs[i]);
+  ClearDepStatus (root, DEPTREE_VISITED);
+}
+
+/* Fills item in from export i of the compact module self, but for
+ * forward
+ */
+static void FillExport (struct DepTreeElement *self, uint64_t i, struct ExportTableItem *item)
+{
+  struct CompactTables *tables = self->compact;
+  memset (item, 0, sizeof (struct ExportTableItem));
+  item->name = SymbolString (tables->symbols, tables->export_name[i]);
+  item->ordinal = tables->export_ordinal[i];
+  item->forward_str = SymbolString (tables->symbols, tables->export_forward_str[i]);
+  item->forward_state = tables->export_forward_state[i];
+  item->section_index = tables->export_section_index[i];
+  item->address_offset = tables->export_address_offset[i];
+  if (item->forward_state == FORWARD_DONE)
+    item->forward_module = tables->export_forward_module[i];
+}
+
+struct ExportTableItem *GetExport (struct DepTreeElement *self, uint64_t i, struct ExportView *view)
+{
+  struct ExportTableItem *item = &view->item;
+  struct DepTreeElement *module;
+  if (self->compact == NULL)
+    return &self->exports[i];
+  FillExport (self, i, item);
+  module = item->forward_module;
+  if (module != NULL && module->compact != NULL)
+  {
+    FillExport (module, self->compact->export_forward[i] - 1, &view->forward);
+    item->forward = &view->forward;
+  }
+  else if (module != NULL)
+    item->forward = &module->exports[self->compact->export_forward[i] - 1];
+  return item;
+}
+
+struct ImportTableItem *GetImport (struct DepTreeElement *self, uint64_t i, struct ImportView *view)
+{
+  struct CompactTables *tables = self->compact;
+  struct ImportTableItem *item = &view->item;
+  if (tables == NULL)
+    return &self->imports[i];
+  memset (item, 0, sizeof (struct ImportTableItem));
+  item->orig_address = tables->import_orig_address[i];
+  item->address = tables->import_address != NULL ? tables->import_address[i] : 0;
+  item->name = SymbolString (tables->symbols, tables->import_name[i]);
+  item->ordinal = tables->import_ordinal[i];
+  item->is_delayed = tables->import_delayed[i];
+  item->dll = tables->import_dll[i];
+  if (tables->import_mapped[i] != 0)
+    item->mapped = GetExport (item->dll, tables->import_mapped[i] - 1, &view->mapped);
+  return item;
+}
+
+uint64_t GetDepTreeBytes (struct DepTreeElement *root)
+{
+  uint64_t bytes = root->arena != NULL ? root->arena->bytes : 0;
+  if (root->symbols != NULL)
+    bytes += root->symbols->symbols_size * sizeof (char *) + root->symbols->slots_size * sizeof (DWORD);
+  return bytes;
+}
+
+Session *NewSession (void)
+{
+  Session *session = (Session *) calloc (1, sizeof (Session));
+  if (session == NULL)
+    return NULL;
+  session->loader = *GetImageLoader (NULL);
+  session->jobs = 1;
+  return session;
+}
+
+void DestroySession (Session *session)
+{
+  if (session == NULL)
+    return;
+  SessionReleaseTree (session);
+  SessionDropSearchPaths (session, 0);
+  free (session->searchPaths.path);
+  FreeModuleCache (session->module_cache);
+  FreeApiSetSchema (session->apiset);
+  FreeBuildStats (session->stats);
+  free (session);
+}
+
+void SessionAddSearchPath (Session *session, const char *dir)
+{
+  SearchPaths *sp = &session->searchPaths;
+  sp->path = (char **) realloc (sp->path, (sp->count + 1) * sizeof (char *));
+  sp->path[sp->count++] = strdup (dir);
+}
+
+void SessionDropSearchPaths (Session *session, unsigned count)
+{
+  SearchPaths *sp = &session->searchPaths;
+  while (sp->count > count)
+    free (sp->path[--sp->count]);
+}
+
+void SessionReleaseTree (Session *session)
+{
+  DestroyDepTree (&session->root);
+}
+
+/* Fills cfg in from session, for BuildDepTree () and friends */
+static void SessionConfig (Session *session, BuildTreeConfig *cfg, NameSet *stack, struct ResolveCache *resolved)
+{
+  memset (cfg, 0, sizeof (BuildTreeConfig));
+  cfg->datarelocs = session->datarelocs;
+  cfg->functionrelocs = session->functionrelocs;
+  cfg->recursive = session->recursive;
+  cfg->stack = stack;
+  cfg->searchPaths = &session->searchPaths;
+  cfg->loader = &session->loader;
+  cfg->module_cache = session->module_cache;
+  cfg->resolved = resolved;
+  cfg->stats = session->stats;
+  cfg->apiset = session->apiset;
+  cfg->compact = session->compact;
+}
+
+struct DepTreeElement *SessionBuildTree (Session *session, char **files, int files_len)
+{
+  int i, failed = 0;
+  uint64_t hits, misses, interned, distinct, duplicate_bytes;
+  NameSet stack;
+  BuildTreeConfig cfg;
+  struct DepTreeElement *root = &session->root;
+  struct ResolveCache *resolved = NewResolveCache ();
+
+  SessionReleaseTree (session);
+  if (resolved == NULL)
+    return NULL;
+  memset (&stack, 0, sizeof (stack));
+  SessionConfig (session, &cfg, &stack, resolved);
+  if (session->jobs > 1)
+    cfg.prefetched = PrefetchModules (&cfg, files, files_len, session->jobs);
+  for (i = 0; i < files_len; i++)
+  {
+    struct DepTreeElement *child = NewDep (root, files[i]);
+    if (child == NULL || AddDep (root, child) != 0)
+    {
+      failed = 1;
+      break;
+    }
+    BuildDepTree (&cfg, files[i], root, child);
+    ClearStack (&stack);
+  }
+  if (session->resolve_forwards && !failed)
+  {
+    ResolveForwards (&cfg, root);
+    ClearStack (&stack);
+  }
+  FreeParsedCache (cfg.prefetched);
+  session->stack_lookups += stack.lookups;
+  session->stack_probes_saved += stack.probes_saved;
+  GetResolveCacheStats (resolved, &hits, &misses);
+  session->resolve_hits += hits;
+  session->resolve_misses += misses;
+  FreeResolveCache (resolved);
+  GetSymbolStats (root, &interned, &distinct, &duplicate_bytes);
+  session->symbols_interned += interned;
+  session->symbols_distinct += distinct;
+  session->symbols_duplicate_bytes += duplicate_bytes;
+
+  ClearDepStatus (root, DEPTREE_VISITED | DEPTREE_PROCESSED);
+  return failed || cfg.out_of_memory ? NULL : root;
+}
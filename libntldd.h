@@ -7,9 +7,282 @@
 typedef unsigned __int64 uint64_t;
 typedef __int64 int64_t;
 #endif
+#ifdef _WIN32
 #include <windows.h>
+#else
+/* Enough of windows.h and imagehlp.h to parse PE images elsewhere */
+#include <errno.h>
+#include <strings.h>
+
+typedef unsigned char BYTE, UCHAR, *PUCHAR, *LPBYTE;
+typedef unsigned short WORD;
+typedef uint32_t DWORD, ULONG;
+typedef int32_t LONG;
+typedef int BOOL;
+typedef char CHAR, *PCHAR, *LPSTR;
+typedef const char *PCSTR, *LPCSTR;
+typedef void *PVOID, *HANDLE, *HMODULE;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+/* Paths on the host are not limited to 260 characters */
+#define MAX_PATH 4096
+#define INVALID_HANDLE_VALUE ((HANDLE) (intptr_t) -1)
+
+#define ERROR_FILE_NOT_FOUND ENOENT
+#define GetLastError() ((DWORD) errno)
+#define SetLastError(e) (errno = (int) (e))
+
+#define stricmp strcasecmp
+#define strnicmp strncasecmp
+
+#define IMAGE_DOS_SIGNATURE                0x5A4D
+#define IMAGE_NT_SIGNATURE                 0x00004550
+#define IMAGE_NT_OPTIONAL_HDR32_MAGIC      0x10b
+#define IMAGE_NUMBEROF_DIRECTORY_ENTRIES   16
+#define IMAGE_DIRECTORY_ENTRY_EXPORT       0
+#define IMAGE_DIRECTORY_ENTRY_IMPORT       1
+#define IMAGE_SIZEOF_SHORT_NAME            8
+
+typedef struct _IMAGE_DOS_HEADER
+{
+    WORD  e_magic;
+    WORD  e_cblp;
+    WORD  e_cp;
+    WORD  e_crlc;
+    WORD  e_cparhdr;
+    WORD  e_minalloc;
+    WORD  e_maxalloc;
+    WORD  e_ss;
+    WORD  e_sp;
+    WORD  e_csum;
+    WORD  e_ip;
+    WORD  e_cs;
+    WORD  e_lfarlc;
+    WORD  e_ovno;
+    WORD  e_res[4];
+    WORD  e_oemid;
+    WORD  e_oeminfo;
+    WORD  e_res2[10];
+    LONG  e_lfanew;
+} IMAGE_DOS_HEADER, *PIMAGE_DOS_HEADER;
+
+typedef struct _IMAGE_FILE_HEADER
+{
+    WORD  Machine;
+    WORD  NumberOfSections;
+    DWORD TimeDateStamp;
+    DWORD PointerToSymbolTable;
+    DWORD NumberOfSymbols;
+    WORD  SizeOfOptionalHeader;
+    WORD  Characteristics;
+} IMAGE_FILE_HEADER, *PIMAGE_FILE_HEADER;
+
+typedef struct _IMAGE_DATA_DIRECTORY
+{
+    DWORD VirtualAddress;
+    DWORD Size;
+} IMAGE_DATA_DIRECTORY, *PIMAGE_DATA_DIRECTORY;
+
+typedef struct _IMAGE_OPTIONAL_HEADER32
+{
+    WORD    Magic;
+    BYTE    MajorLinkerVersion;
+    BYTE    MinorLinkerVersion;
+    DWORD   SizeOfCode;
+    DWORD   SizeOfInitializedData;
+    DWORD   SizeOfUninitializedData;
+    DWORD   AddressOfEntryPoint;
+    DWORD   BaseOfCode;
+    DWORD   BaseOfData;
+    DWORD   ImageBase;
+    DWORD   SectionAlignment;
+    DWORD   FileAlignment;
+    WORD    MajorOperatingSystemVersion;
+    WORD    MinorOperatingSystemVersion;
+    WORD    MajorImageVersion;
+    WORD    MinorImageVersion;
+    WORD    MajorSubsystemVersion;
+    WORD    MinorSubsystemVersion;
+    DWORD   Win32VersionValue;
+    DWORD   SizeOfImage;
+    DWORD   SizeOfHeaders;
+    DWORD   CheckSum;
+    WORD    Subsystem;
+    WORD    DllCharacteristics;
+    DWORD   SizeOfStackReserve;
+    DWORD   SizeOfStackCommit;
+    DWORD   SizeOfHeapReserve;
+    DWORD   SizeOfHeapCommit;
+    DWORD   LoaderFlags;
+    DWORD   NumberOfRvaAndSizes;
+    IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER32, *PIMAGE_OPTIONAL_HEADER32;
+
+typedef struct _IMAGE_OPTIONAL_HEADER64
+{
+    WORD        Magic;
+    BYTE        MajorLinkerVersion;
+    BYTE        MinorLinkerVersion;
+    DWORD       SizeOfCode;
+    DWORD       SizeOfInitializedData;
+    DWORD       SizeOfUninitializedData;
+    DWORD       AddressOfEntryPoint;
+    DWORD       BaseOfCode;
+    uint64_t    ImageBase;
+    DWORD       SectionAlignment;
+    DWORD       FileAlignment;
+    WORD        MajorOperatingSystemVersion;
+    WORD        MinorOperatingSystemVersion;
+    WORD        MajorImageVersion;
+    WORD        MinorImageVersion;
+    WORD        MajorSubsystemVersion;
+    WORD        MinorSubsystemVersion;
+    DWORD       Win32VersionValue;
+    DWORD       SizeOfImage;
+    DWORD       SizeOfHeaders;
+    DWORD       CheckSum;
+    WORD        Subsystem;
+    WORD        DllCharacteristics;
+    uint64_t    SizeOfStackReserve;
+    uint64_t    SizeOfStackCommit;
+    uint64_t    SizeOfHeapReserve;
+    uint64_t    SizeOfHeapCommit;
+    DWORD       LoaderFlags;
+    DWORD       NumberOfRvaAndSizes;
+    IMAGE_DATA_DIRECTORY DataDirectory[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
+} IMAGE_OPTIONAL_HEADER64, *PIMAGE_OPTIONAL_HEADER64;
+
+/* Only used to locate the optional header, which is read through
+ * one of the two types above depending on its Magic
+ */
+typedef struct _IMAGE_NT_HEADERS
+{
+    DWORD Signature;
+    IMAGE_FILE_HEADER FileHeader;
+    IMAGE_OPTIONAL_HEADER32 OptionalHeader;
+} IMAGE_NT_HEADERS, *PIMAGE_NT_HEADERS;
+
+typedef struct _IMAGE_SECTION_HEADER
+{
+    BYTE  Name[IMAGE_SIZEOF_SHORT_NAME];
+    union
+    {
+        DWORD PhysicalAddress;
+        DWORD VirtualSize;
+    } Misc;
+    DWORD VirtualAddress;
+    DWORD SizeOfRawData;
+    DWORD PointerToRawData;
+    DWORD PointerToRelocations;
+    DWORD PointerToLinenumbers;
+    WORD  NumberOfRelocations;
+    WORD  NumberOfLinenumbers;
+    DWORD Characteristics;
+} IMAGE_SECTION_HEADER, *PIMAGE_SECTION_HEADER;
+
+typedef struct _IMAGE_IMPORT_DESCRIPTOR
+{
+    union
+    {
+        DWORD Characteristics;
+        DWORD OriginalFirstThunk;
+    };
+    DWORD TimeDateStamp;
+    DWORD ForwarderChain;
+    DWORD Name;
+    DWORD FirstThunk;
+} IMAGE_IMPORT_DESCRIPTOR, *PIMAGE_IMPORT_DESCRIPTOR;
+
+typedef struct _IMAGE_IMPORT_BY_NAME
+{
+    WORD Hint;
+    CHAR Name[1];
+} IMAGE_IMPORT_BY_NAME, *PIMAGE_IMPORT_BY_NAME;
+
+typedef struct _IMAGE_EXPORT_DIRECTORY
+{
+    DWORD Characteristics;
+    DWORD TimeDateStamp;
+    WORD  MajorVersion;
+    WORD  MinorVersion;
+    DWORD Name;
+    DWORD Base;
+    DWORD NumberOfFunctions;
+    DWORD NumberOfNames;
+    DWORD AddressOfFunctions;
+    DWORD AddressOfNames;
+    DWORD AddressOfNameOrdinals;
+} IMAGE_EXPORT_DIRECTORY, *PIMAGE_EXPORT_DIRECTORY;
+
+typedef struct _IMAGE_THUNK_DATA64
+{
+    union
+    {
+        uint64_t ForwarderString;
+        uint64_t Function;
+        uint64_t Ordinal;
+        uint64_t AddressOfData;
+    } u1;
+} IMAGE_THUNK_DATA64, *PIMAGE_THUNK_DATA64;
+
+typedef struct _IMAGE_THUNK_DATA32
+{
+    union
+    {
+        DWORD ForwarderString;
+        DWORD Function;
+        DWORD Ordinal;
+        DWORD AddressOfData;
+    } u1;
+} IMAGE_THUNK_DATA32, *PIMAGE_THUNK_DATA32;
+
+typedef struct _IMAGE_DELAYLOAD_DESCRIPTOR
+{
+    union
+    {
+        DWORD AllAttributes;
+        struct
+        {
+            DWORD RvaBased:1;
+            DWORD ReservedAttributes:31;
+        };
+    } Attributes;
+
+    DWORD DllNameRVA;
+    DWORD ModuleHandleRVA;
+    DWORD ImportAddressTableRVA;
+    DWORD ImportNameTableRVA;
+    DWORD BoundImportAddressTableRVA;
+    DWORD UnloadInformationTableRVA;
+    DWORD TimeDateStamp;
+} IMAGE_DELAYLOAD_DESCRIPTOR, *PIMAGE_DELAYLOAD_DESCRIPTOR;
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _LOADED_IMAGE
+{
+    LPSTR                 ModuleName;
+    HANDLE                hFile;
+    PUCHAR                MappedAddress;
+    PIMAGE_NT_HEADERS     FileHeader;
+    PIMAGE_SECTION_HEADER LastRvaSection;
+    ULONG                 NumberOfSections;
+    PIMAGE_SECTION_HEADER Sections;
+    ULONG                 Characteristics;
+    BOOL                  fSystemImage;
+    BOOL                  fDOSImage;
+    LIST_ENTRY            Links;
+    ULONG                 SizeOfImage;
+} LOADED_IMAGE, *PLOADED_IMAGE;
+#endif
 
-#if (defined(_MSC_VER) && _MSC_VER < 1500) || defined(__TINYC__)
+#if defined(_WIN32) && ((defined(_MSC_VER) && _MSC_VER < 1500) || defined(__TINYC__))
 typedef struct _IMAGE_DELAYLOAD_DESCRIPTOR
 {
     union
@@ -32,7 +305,7 @@ typedef struct _IMAGE_DELAYLOAD_DESCRIPTOR
 } IMAGE_DELAYLOAD_DESCRIPTOR, *PIMAGE_DELAYLOAD_DESCRIPTOR;
 #endif
 
-#if defined(_MSC_VER) && _MSC_VER < 1200
+#if defined(_WIN32) && defined(_MSC_VER) && _MSC_VER < 1200
 typedef struct _IMAGE_THUNK_DATA64 {
     union {
         uint64_t ForwarderString;
@@ -146,6 +419,14 @@ typedef struct _IMAGE_OPTIONAL_HEADER64 {
 #define NTLDD_VERSION_MINOR 2
 
 struct DepTreeElement;
+struct DepIndex;
+struct ExportIndex;
+struct Arena;
+struct ParsedCache;
+struct ModuleCache;
+struct ResolveCache;
+struct CompactTables;
+struct SymbolTable;
 
 struct ExportTableItem
 {
@@ -153,11 +434,22 @@ struct ExportTableItem
   char *name;
   WORD ordinal;
   char *forward_str;
+  /* Where a forwarder ends up once ResolveForwards () has followed
+   * the whole chain: the export and the module that has it
+   */
   struct ExportTableItem *forward;
+  struct DepTreeElement *forward_module;
+  /* FORWARD_* */
+  int forward_state;
   int section_index;
   DWORD address_offset;
 };
 
+#define FORWARD_NONE    0 /* not followed yet */
+#define FORWARD_PENDING 1 /* being followed; reaching it again is a cycle */
+#define FORWARD_DONE    2 /* forward and forward_module are set */
+#define FORWARD_BROKEN  3 /* leads to a missing module or export, or loops */
+
 struct ImportTableItem
 {
   uint64_t orig_address;
@@ -186,6 +478,31 @@ struct DepTreeElement
   struct ExportTableItem *exports;
   int machineType;
   int isPE32plus;
+  struct DepTreeElement *parent;
+  /* Every module this one imports from, including the ones that were
+   * first found elsewhere in the tree and so are not among childs
+   */
+  struct DepTreeElement **deps;
+  uint64_t deps_len;
+  /* Only set on the root: (module, machineType) index of every
+   * element added to the tree with AddDep ()
+   */
+  struct DepIndex *index;
+  /* Only set on the root: holds the elements, arrays and strings of
+   * the whole tree
+   */
+  struct Arena *arena;
+  /* Only set on the root: every export, import and forward name of the
+   * tree, interned
+   */
+  struct SymbolTable *symbols;
+  /* Built on first use by import binding */
+  struct ExportIndex *export_index;
+  /* Set, instead of exports and imports, in trees built with
+   * BuildTreeConfig.compact; exports_len and imports_len still count
+   * them. Read entries through GetExport () and GetImport ().
+   */
+  struct CompactTables *compact;
 };
 
 #define DEPTREE_VISITED    0x00000001
@@ -194,7 +511,51 @@ struct DepTreeElement
 
 int ClearDepStatus (struct DepTreeElement *self, uint64_t flags);
 
-void AddDep (struct DepTreeElement *parent, struct DepTreeElement *child);
+/* Room for GetExport () and GetImport () to put together an entry of
+ * a compact module
+ */
+struct ExportView
+{
+  struct ExportTableItem item;
+  struct ExportTableItem forward;
+};
+
+struct ImportView
+{
+  struct ImportTableItem item;
+  struct ExportView mapped;
+};
+
+/* Entry i of the exports or imports of self, whichever the layout.
+ * Entries of compact modules are put together in view, and last until
+ * it is used again; they have no address, and their mapped and
+ * forward members only lead to other views.
+ */
+struct ExportTableItem *GetExport (struct DepTreeElement *self, uint64_t i, struct ExportView *view);
+
+struct ImportTableItem *GetImport (struct DepTreeElement *self, uint64_t i, struct ImportView *view);
+
+/* Bytes allocated for the elements, arrays and strings of the tree */
+uint64_t GetDepTreeBytes (struct DepTreeElement *root);
+
+/* Names interned while building the tree, how many of them were
+ * distinct, and the bytes the repeated ones took; compact trees store
+ * each distinct name only once
+ */
+void GetSymbolStats (struct DepTreeElement *root, uint64_t *interned, uint64_t *distinct, uint64_t *duplicate_bytes);
+
+/* Returns -1, leaving child out, if there is no memory left */
+int AddDep (struct DepTreeElement *parent, struct DepTreeElement *child);
+
+/* Returns a zeroed element, owned by the tree of root, with a copy of
+ * module (which may be NULL), or NULL if there is no memory left
+ */
+struct DepTreeElement *NewDep (struct DepTreeElement *root, const char *module);
+
+/* Frees everything the tree of root owns, and clears root itself */
+void DestroyDepTree (struct DepTreeElement *root);
+
+int FindDep (struct DepTreeElement *root, char *name, int machineType, struct DepTreeElement **result);
 
 typedef struct SearchPaths_t
 {
@@ -203,19 +564,263 @@ typedef struct SearchPaths_t
 } SearchPaths;
 
 
+/* Case-insensitive set of module names that were already processed.
+ * A zero-filled NameSet is empty; names are copied in on insertion.
+ */
+struct NameSetEntry
+{
+    char *name;
+    DWORD hash;
+    uint64_t pushed_at;
+};
+
+typedef struct NameSet_t
+{
+    uint64_t size;
+    uint64_t len;
+    struct NameSetEntry *entries;
+    /* Number of PushStack () calls, i.e. the length the old linear
+     * stack would have had
+     */
+    uint64_t pushes;
+    uint64_t lookups;
+    /* stricmp () calls the linear stack scan would have made, minus
+     * the ones the hash set actually made
+     */
+    uint64_t probes_saved;
+} NameSet;
+
+/* Returns -1 if out of memory */
+int PushStack (NameSet *stack, char *name);
+
+int StackContains (NameSet *stack, char *name);
+
+/* Frees the names in stack and empties it, keeping the counters */
+void ClearStack (NameSet *stack);
+
+/* Image loader backend. map_and_load () opens name as given, then
+ * searches path for it (the platform default search if path is
+ * NULL), appending .DLL or .EXE if it has no extension. On success
+ * ModuleName is set to the path found by the search, or to an
+ * empty string if name was opened as given. On failure the last
+ * error is ERROR_FILE_NOT_FOUND if no file was found.
+ *
+ * Loaders that do not map the whole file provide load_range (), and
+ * only guarantee that the headers and section table are readable
+ * after map_and_load (). The rest of MappedAddress is laid out like
+ * the file, and [offset, offset + size) of it becomes readable once
+ * load_range () has been called for it.
+ */
+typedef struct ImageLoader_t
+{
+    const char *name;
+    BOOL (*map_and_load) (struct ImageLoader_t *loader, PCSTR name, PCSTR path, PLOADED_IMAGE img, BOOL bDotDll);
+    BOOL (*unmap_and_load) (struct ImageLoader_t *loader, PLOADED_IMAGE img);
+    BOOL (*load_range) (struct ImageLoader_t *loader, PLOADED_IMAGE img, DWORD offset, DWORD size);
+    /* I/O counters, updated by the loader */
+    uint64_t images_loaded;
+    uint64_t bytes_mapped;
+    uint64_t bytes_read;
+} ImageLoader;
+
+/* Returns the loader with the given name ("win32", "mmap" or
+ * "partial"), or the platform default if name is NULL. Returns NULL
+ * for unknown names. Callers that want their own I/O counters should
+ * use a copy of the returned loader.
+ */
+ImageLoader *GetImageLoader (const char *name);
+
+/* Where the time of building trees went: wall time and call counts
+ * per phase, and the modules that took longest to load. Gathered
+ * through BuildTreeConfig.stats, and not at all if libntldd was
+ * built with NTLDD_NO_STATS. Times are in nanoseconds, summed over
+ * all threads when modules are prefetched.
+ */
+#define STATS_SEARCH 0  /* looking for modules in the search paths */
+#define STATS_MAP 1     /* loading the modules that were found */
+#define STATS_PARSE 2   /* reading their exports and imports */
+#define STATS_FINDDEP 3 /* FindDep () */
+#define STATS_BIND 4    /* matching imports to exports */
+#define STATS_PHASES 5
+#define STATS_SLOWEST 10
+
+/* Returns NULL if out of memory */
+struct BuildStats *NewBuildStats (void);
+
+void FreeBuildStats (struct BuildStats *stats);
+
+void GetPhaseStats (struct BuildStats *stats, int phase, uint64_t *time, uint64_t *calls);
+
+/* Sets name and time of the i-th slowest module to load, from 0;
+ * returns 0 if there are not that many
+ */
+int GetSlowestModule (struct BuildStats *stats, int i, const char **name, uint64_t *time);
+
+/* API Set schema: which module implements each virtual api-ms-win-*
+ * and ext-ms-win-* module. Versions 2 (Windows 7), 4 (Windows 8.1) and
+ * 6 (Windows 10 and later) of the schema are understood.
+ * LoadApiSetSchema () takes either apisetschema.dll or the contents
+ * of its .apiset section; both return NULL if the schema is not valid
+ * or could not be read.
+ */
+struct ApiSetSchema *ParseApiSetSchema (const void *data, size_t size);
+
+struct ApiSetSchema *LoadApiSetSchema (const char *path);
+
+void FreeApiSetSchema (struct ApiSetSchema *schema);
+
+/* Returns the module that implements the contract name when importer
+ * (a module name or path, or NULL) imports it, or NULL if name is not
+ * a contract of schema or has no host
+ */
+const char *ResolveApiSet (struct ApiSetSchema *schema, const char *name, const char *importer);
+
 typedef struct BuildTreeConfig_t
 {
     int datarelocs;
     int functionrelocs;
     int recursive;
     int on_self;
-    char ***stack;
-    uint64_t *stack_len;
-    uint64_t *stack_size;
+    NameSet *stack;
     SearchPaths* searchPaths;
+    /* NULL means GetImageLoader (NULL) */
+    ImageLoader *loader;
+    /* Modules parsed ahead of time by PrefetchModules (), or NULL */
+    struct ParsedCache *prefetched;
+    /* Parsed modules kept across runs, or NULL */
+    struct ModuleCache *module_cache;
+    /* Search results shared by every BuildDepTree () call that uses
+     * the same searchPaths, or NULL
+     */
+    struct ResolveCache *resolved;
+    /* NULL unless statistics are wanted */
+    struct BuildStats *stats;
+    /* Where API Set contracts are resolved, or NULL */
+    struct ApiSetSchema *apiset;
+    /* Keep exports and imports in the compact layout; every call that
+     * builds a given tree has to agree on this
+     */
+    int compact;
+    /* Set by BuildDepTree () once memory ran out; the tree is then
+     * missing what could not be allocated
+     */
+    int out_of_memory;
 } BuildTreeConfig;
 
 int BuildDepTree (BuildTreeConfig* cfg, char *name, struct DepTreeElement *root, struct DepTreeElement *self);
 
+/* Follows every forwarder that an import in the tree of root is bound
+ * to, through as many modules as it takes. Each export is followed
+ * once, however many modules import it. Modules that a forward leads
+ * to and that are not in the tree yet are only loaded then, with
+ * BuildDepTree (cfg, ...), and added to root after its other childs.
+ */
+void ResolveForwards (BuildTreeConfig *cfg, struct DepTreeElement *root);
+
+/* Loads and parses names and everything they import, recursively, on
+ * threads threads. BuildDepTree () takes modules from the result
+ * (through cfg->prefetched) instead of loading them again, so the
+ * tree it builds is the same as without prefetching. Only
+ * cfg->searchPaths, cfg->loader, cfg->module_cache, cfg->resolved
+ * and cfg->stats are used; the loader's counters are updated once
+ * all threads are done. Returns NULL if out of memory, in which case
+ * BuildDepTree () simply loads every module itself.
+ */
+struct ParsedCache *PrefetchModules (BuildTreeConfig *cfg, char **names, int names_len, int threads);
+
+void FreeParsedCache (struct ParsedCache *cache);
+
+/* Module cache: the parsed exports and imports of every module loaded
+ * through it, keyed by full path and checked against the file's size,
+ * modification time, TimeDateStamp and CheckSum. Modules found in it
+ * are not loaded at all, and are only decoded from the cache file when
+ * they are looked up, so that a run over a tree in which few files
+ * changed only parses those. LoadModuleCache () returns an empty cache if path
+ * does not exist or is not a valid cache file, and NULL if out of
+ * memory; SaveModuleCache () only writes if something was added, and
+ * returns 0 on success.
+ * A cache loaded from a NULL path starts empty and is only meant to
+ * last for the run. No module of a tree built with a cache has a
+ * mapped_address, whether it was in the cache or not.
+ */
+struct ModuleCache *LoadModuleCache (const char *path);
+
+int SaveModuleCache (struct ModuleCache *cache, const char *path);
+
+void FreeModuleCache (struct ModuleCache *cache);
+
+void GetModuleCacheStats (struct ModuleCache *cache, uint64_t *hits, uint64_t *misses);
+
+/* Remembers where each (name, machine type) was found among the
+ * search paths, or that it was not found, so that it is searched for
+ * only once. Assumes the files do not change while it is in use.
+ * NewResolveCache () returns NULL if out of memory.
+ */
+struct ResolveCache *NewResolveCache (void);
+
+void FreeResolveCache (struct ResolveCache *cache);
+
+void GetResolveCacheStats (struct ResolveCache *cache, uint64_t *hits, uint64_t *misses);
+
+
+
+/* Everything it takes to analyse modules over and over: search paths,
+ * loader, caches and the last tree built. Members are set up after
+ * NewSession (), and pointers set in them become the session's own:
+ * DestroySession () frees them along with everything else. Memory
+ * stays the same from one SessionBuildTree () call to the next, but
+ * for what the module cache keeps.
+ */
+typedef struct Session_t
+{
+    /* Searched in order, before the platform default search */
+    SearchPaths searchPaths;
+    ImageLoader loader;
+    /* Threads to load and parse modules on */
+    int jobs;
+    int datarelocs;
+    int functionrelocs;
+    int recursive;
+    int compact;
+    /* Run ResolveForwards () on every tree */
+    int resolve_forwards;
+    /* Each of these may be NULL */
+    struct ModuleCache *module_cache;
+    struct ApiSetSchema *apiset;
+    struct BuildStats *stats;
+    /* Summed over every SessionBuildTree () call */
+    uint64_t stack_lookups;
+    uint64_t stack_probes_saved;
+    uint64_t resolve_hits;
+    uint64_t resolve_misses;
+    uint64_t symbols_interned;
+    uint64_t symbols_distinct;
+    uint64_t symbols_duplicate_bytes;
+    /* Parent of the trees of the last SessionBuildTree () call */
+    struct DepTreeElement root;
+} Session;
+
+/* Returns a session with the default loader, one job and no search
+ * paths or caches, or NULL if out of memory
+ */
+Session *NewSession (void);
+
+void DestroySession (Session *session);
+
+void SessionAddSearchPath (Session *session, const char *dir);
+
+/* Removes the search paths from the count-th one on */
+void SessionDropSearchPaths (Session *session, unsigned count);
+
+/* Frees the last tree and builds the trees of files, as
+ * session->root.childs[0] to childs[files_len - 1], with no
+ * DEPTREE_VISITED or DEPTREE_PROCESSED flags left. Returns
+ * &session->root, which stays valid until the next call, or NULL if
+ * memory ran out while building the trees.
+ */
+struct DepTreeElement *SessionBuildTree (Session *session, char **files, int files_len);
+
+/* Frees the last tree */
+void SessionReleaseTree (Session *session);
 
 #endif
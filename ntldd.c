@@ -23,14 +23,24 @@ Code is mostly written after
 MSDN Magazine articles
 */
 
+#ifdef _WIN32
 #include <windows.h>
 
 #include <imagehlp.h>
 
 #include <winnt.h>
 
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "libntldd.h"
 
@@ -48,6 +58,7 @@ MSDN Magazine articles
 #define VAL_UI64(x) x ## ULL
 #endif
 
+#ifdef _WIN32
 typedef BOOL (WINAPI *tW64P)(HANDLE, PBOOL);
 typedef BOOL (WINAPI *tFSDisable)(PVOID*);
 typedef BOOL (WINAPI *tFSRevert)(PVOID);
@@ -59,6 +70,7 @@ tFSRevert pRevertFunc = NULL;
 tGetSystemWow64DirectoryA pGetSystemWow64DirectoryA = NULL;
 
 BOOL bIsWow64 = FALSE;
+#endif
 char cTextEditor[MAX_PATH];
 int use_text_editor = 0;
 
@@ -84,6 +96,125 @@ char* u64tox(U64_TYPE i, char buf[32], int pad) {
 }
 
 
+/* Machine-readable output is built up here and written to fp in large
+ * blocks, rather than going through stdio one field at a time
+ */
+#define OUT_BUFFER_SIZE (256 * 1024)
+static char out_buffer[OUT_BUFFER_SIZE];
+static size_t out_len = 0;
+
+void OutFlush (void)
+{
+  if (out_len > 0)
+    fwrite (out_buffer, 1, out_len, fp);
+  out_len = 0;
+}
+
+void OutBytes (const void *data, size_t len)
+{
+  if (len > OUT_BUFFER_SIZE - out_len)
+  {
+    OutFlush ();
+    if (len > OUT_BUFFER_SIZE)
+    {
+      fwrite (data, 1, len, fp);
+      return;
+    }
+  }
+  memcpy (&out_buffer[out_len], data, len);
+  out_len += len;
+}
+
+void OutChar (char c)
+{
+  if (out_len == OUT_BUFFER_SIZE)
+    OutFlush ();
+  out_buffer[out_len++] = c;
+}
+
+void OutStr (const char *s)
+{
+  OutBytes (s, strlen (s));
+}
+
+/* Like printf ()'s %*d */
+void OutDec (I64_TYPE v, int width)
+{
+  char buf[32];
+  char *p = buf + sizeof (buf);
+  U64_TYPE n = v < 0 ? (U64_TYPE) -v : (U64_TYPE) v;
+  do
+  {
+    *--p = (char) ('0' + n % 10);
+    n /= 10;
+  } while (n > 0);
+  if (v < 0)
+    *--p = '-';
+  while (buf + sizeof (buf) - p < width)
+    *--p = ' ';
+  OutBytes (p, buf + sizeof (buf) - p);
+}
+
+/* Like printf ()'s %0*llx */
+void OutHex (U64_TYPE v, int width)
+{
+  static const char hex[] = "0123456789abcdef";
+  char buf[32];
+  char *p = buf + sizeof (buf);
+  do
+  {
+    *--p = hex[v & 15];
+    v >>= 4;
+  } while (v > 0);
+  while (buf + sizeof (buf) - p < width)
+    *--p = '0';
+  OutBytes (p, buf + sizeof (buf) - p);
+}
+
+/* Like printf ()'s %*s with depth and a string of at most one space,
+ * which is how the tree is indented
+ */
+void OutIndent (int depth)
+{
+  static const char spaces[] = "                                ";
+  while (depth > 32)
+  {
+    OutBytes (spaces, 32);
+    depth -= 32;
+  }
+  OutBytes (spaces, depth);
+}
+
+/* Like msvcrt's %p: upper case hex digits, padded to the width of a
+ * pointer and with no 0x, which glibc's %p would add
+ */
+void OutPointer (void *p)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char buf[2 * sizeof (void *)];
+  U64_TYPE v = (U64_TYPE) (uintptr_t) p;
+  size_t i;
+  for (i = sizeof (buf); i > 0; i--, v >>= 4)
+    buf[i - 1] = hex[v & 15];
+  OutBytes (buf, sizeof (buf));
+}
+
+void OutU32LE (DWORD v)
+{
+  unsigned char b[4];
+  b[0] = (unsigned char) v;
+  b[1] = (unsigned char) (v >> 8);
+  b[2] = (unsigned char) (v >> 16);
+  b[3] = (unsigned char) (v >> 24);
+  OutBytes (b, 4);
+}
+
+void OutU64LE (U64_TYPE v)
+{
+  OutU32LE ((DWORD) v);
+  OutU32LE ((DWORD) (v >> 32));
+}
+
 void changeOutputDest() {
   fp = fopen("ntldd.txt","w");
 }
@@ -124,16 +255,42 @@ void printhelp(char *argv0)
   fprintf(fp,"Usage: %s [OPTION]... FILE...\n\
 OPTIONS:\n\
 --version             Displays version\n\
--v, --verbose         Does not work\n\
+-v, --verbose         Prints lookup and I/O counters to stderr\n\
+--stats               Prints the time and calls of each phase, cache\n\
+                        hit rates and the slowest modules to stderr\n\
+--loader NAME         Reads images with the given loader; `partial'\n\
+                        reads only the headers and the sections that\n\
+                        are looked at\n\
+-j, --jobs N          Loads and parses modules on N threads\n\
+--cache FILE          Keeps parsed modules in FILE between runs; module\n\
+                        addresses are then printed as 0, as cached\n\
+                        modules are never loaded\n\
+--compact             Keeps exports and imports in a smaller layout,\n\
+                        for large trees\n\
+--apiset FILE         Resolves api-ms-win-* and ext-ms-win-* modules to\n\
+                        their host with the API Set schema in FILE\n\
+                        (apisetschema.dll or its .apiset section); the\n\
+                        system's apisetschema.dll is used on Windows\n\
 -u, --unused          Does not work\n\
 -d, --data-relocs     Does not work\n\
 -r, --function-relocs Does not work\n\
+--format FORMAT       Writes `text' (the default), `jsonl' (one JSON\n\
+                        object per line) or `binary' (length-prefixed\n\
+                        records) output\n\
 -R, --recursive       Lists dependencies recursively,\n\
                         eliminating duplicates\n\
+--scan DIR            Lists the dependencies, direct or not, of every\n\
+                        module under DIR, loading each one only once\n\
+--serve               Reads file names from stdin, one per line, and\n\
+                        answers each like a separate run, ending the\n\
+                        answer with a `.' line; modules stay loaded\n\
+                        until their file changes, and their addresses\n\
+                        are printed as 0 like with --cache\n\
 -T, --text-editor     Use externel editor for display output (always on in Win32s)\n\
 -D, --search-dir      Additional search directory\n\
 -e, --list-exports    Lists exports of a module (single file only)\n\
--i, --list-imports    Lists imports of modules\n\
+-i, --list-imports    Lists imports of modules, and the exports that\n\
+                        forwarded ones end up at\n\
 --def-output          Print exports in DEF format\n\
 --help                Displays this message\n\
 \n\
@@ -142,6 +299,7 @@ For bug reporting instructions, please see:\n\
 <somewhere>.", argv0);
 }
 
+#ifdef _WIN32
 char* mybasename(char* path)
 {
     char fullpath[MAX_PATH], *p;
@@ -149,21 +307,199 @@ char* mybasename(char* path)
     return p;
 }
 
+/* Copies the absolute path of the directory containing path to dir */
+void mydirname(char* path, char dir[MAX_PATH])
+{
+    char *p;
+    memset(dir, 0, MAX_PATH);
+    GetFullPathNameA(path, MAX_PATH, dir, &p);
+    *p = '\0';
+}
+#else
+char* mybasename(char* path)
+{
+    char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+void mydirname(char* path, char dir[MAX_PATH])
+{
+    char *p;
+    memset(dir, 0, MAX_PATH);
+    if (path[0] == '/' || getcwd(dir, MAX_PATH - 1) == NULL)
+        dir[0] = '\0';
+    else
+        strcat(dir, "/");
+    strncat(dir, path, MAX_PATH - strlen(dir) - 1);
+    p = strrchr(dir, '/');
+    p[1] = '\0';
+}
+#endif
+
+/* The part of path after the last separator, without touching the
+ * file system
+ */
+char *PathBaseName (char *path)
+{
+  char *p = path + strlen (path);
+  while (p > path && strchr ("/\\", p[-1]) == NULL)
+    p--;
+  return p;
+}
+
+/* Modules that --scan picks up */
+int IsImageName (const char *name)
+{
+  static const char *exts[] = { "exe", "dll", "sys", "ocx", "cpl", "drv", "scr", "efi", "ax", NULL };
+  const char *dot = strrchr (name, '.');
+  int i;
+  if (dot == NULL)
+    return 0;
+  for (i = 0; exts[i] != NULL; i++)
+    if (stricmp (dot + 1, exts[i]) == 0)
+      return 1;
+  return 0;
+}
+
+struct ScanEntry
+{
+  char *name;
+  int is_dir;
+};
+
+static int CompareScanEntries (const void *a, const void *b)
+{
+  return strcmp (((const struct ScanEntry *) a)->name, ((const struct ScanEntry *) b)->name);
+}
+
+static void AddScanEntry (struct ScanEntry **entries, int *len, const char *name, int is_dir)
+{
+  *entries = (struct ScanEntry *) realloc (*entries, (*len + 1) * sizeof (struct ScanEntry));
+  (*entries)[*len].name = strdup (name);
+  (*entries)[*len].is_dir = is_dir;
+  *len += 1;
+}
+
+#ifdef _WIN32
+#define DIR_SEPARATOR "\\"
+static int ListDirectory (const char *dir, struct ScanEntry **entries)
+{
+  char pattern[MAX_PATH];
+  WIN32_FIND_DATAA fd;
+  HANDLE h;
+  int len = 0;
+  _snprintf (pattern, MAX_PATH, "%s*", dir);
+  pattern[MAX_PATH - 1] = '\0';
+  h = FindFirstFileA (pattern, &fd);
+  if (h == INVALID_HANDLE_VALUE)
+    return 0;
+  do
+  {
+    if (strcmp (fd.cFileName, ".") == 0 || strcmp (fd.cFileName, "..") == 0)
+      continue;
+    /* Junctions may point back up the tree */
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+      if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+        AddScanEntry (entries, &len, fd.cFileName, 1);
+    }
+    else if (IsImageName (fd.cFileName))
+      AddScanEntry (entries, &len, fd.cFileName, 0);
+  } while (FindNextFileA (h, &fd));
+  FindClose (h);
+  return len;
+}
+#else
+#define DIR_SEPARATOR "/"
+static int ListDirectory (const char *dir, struct ScanEntry **entries)
+{
+  char path[MAX_PATH];
+  struct stat st;
+  struct dirent *de;
+  DIR *d = opendir (dir);
+  int len = 0;
+  if (d == NULL)
+    return 0;
+  while ((de = readdir (d)) != NULL)
+  {
+    if (strcmp (de->d_name, ".") == 0 || strcmp (de->d_name, "..") == 0)
+      continue;
+    snprintf (path, MAX_PATH, "%s%s", dir, de->d_name);
+    /* Symlinked directories may point back up the tree */
+    if (lstat (path, &st) != 0)
+      continue;
+    if (S_ISDIR (st.st_mode))
+      AddScanEntry (entries, &len, de->d_name, 1);
+    else if (IsImageName (de->d_name) && stat (path, &st) == 0 && S_ISREG (st.st_mode))
+      AddScanEntry (entries, &len, de->d_name, 0);
+  }
+  closedir (d);
+  return len;
+}
+#endif
+
+/* Appends every module under dir to *files, and every directory that
+ * holds one to sp. Entries are taken in name order, so that neither
+ * the output nor the search order depends on the file system.
+ */
+void ScanDirectory (const char *dir, char ***files, int *files_len, SearchPaths *sp)
+{
+  char path[MAX_PATH];
+  struct ScanEntry *entries = NULL;
+  int i, len, added = 0;
+
+  strncpy (path, dir, MAX_PATH - 2);
+  path[MAX_PATH - 2] = '\0';
+  if (path[0] != '\0' && strchr ("/\\", path[strlen (path) - 1]) == NULL)
+    strcat (path, DIR_SEPARATOR);
+  len = ListDirectory (path, &entries);
+  qsort (entries, len, sizeof (struct ScanEntry), CompareScanEntries);
+  for (i = 0; i < len; i++)
+  {
+    char *full = (char *) malloc (strlen (path) + strlen (entries[i].name) + 1);
+    strcpy (full, path);
+    strcat (full, entries[i].name);
+    if (entries[i].is_dir)
+    {
+      ScanDirectory (full, files, files_len, sp);
+      free (full);
+    }
+    else
+    {
+      if (!added)
+      {
+        sp->count++;
+        sp->path = (char**) realloc (sp->path, sp->count * sizeof (char*));
+        sp->path[sp->count - 1] = strdup (path);
+        added = 1;
+      }
+      *files = (char **) realloc (*files, (*files_len + 1) * sizeof (char *));
+      (*files)[(*files_len)++] = full;
+    }
+    free (entries[i].name);
+  }
+  free (entries);
+}
+
 int PrintImageLinks (int first, int verbose, int unused, int datarelocs, int functionrelocs, struct DepTreeElement *self, int recursive, int list_exports, int def_output, int list_imports, int depth)
 {
   uint64_t i;
   int unresolved = 0;
+  struct ExportView export_view;
+  struct ImportView import_view;
   self->flags |= DEPTREE_VISITED;
 
   if (def_output)
   {
-    fprintf (fp, "LIBRARY %s\n\n\
-EXPORTS\n", mybasename(self->module));
+    OutStr ("LIBRARY ");
+    OutStr (mybasename(self->module));
+    OutStr ("\n\nEXPORTS\n");
     for (i = 0; i < self->exports_len; i++)
     {
-      struct ExportTableItem *item = &self->exports[i];
+      struct ExportTableItem *item = GetExport (self, i, &export_view);
 
-      fprintf (fp,"%s\n", item->name);
+      OutStr (item->name ? item->name : "(null)");
+      OutChar ('\n');
     }
     return 0;
   }
@@ -171,32 +507,49 @@ EXPORTS\n", mybasename(self->module));
   {
     for (i = 0; i < self->exports_len; i++)
     {
-      struct ExportTableItem *item = &self->exports[i];
+      struct ExportTableItem *item = GetExport (self, i, &export_view);
 
-      fprintf (fp,"%*s[%u] %s (0x%lx)%s%s <%d>\n", depth, depth > 0 ? " " : "", \
-          item->ordinal, item->name, item->address_offset, \
-          item->forward_str ? " ->" : "", \
-          item->forward_str ? item->forward_str : "",
-          item->section_index);
+      OutIndent (depth);
+      OutChar ('[');
+      OutDec (item->ordinal, 0);
+      OutStr ("] ");
+      OutStr (item->name ? item->name : "(null)");
+      OutStr (" (0x");
+      OutHex (item->address_offset, 0);
+      OutChar (')');
+      if (item->forward_str)
+      {
+        OutStr (" ->");
+        OutStr (item->forward_str);
+      }
+      OutStr (" <");
+      OutDec (item->section_index, 0);
+      OutStr (">\n");
     }
     return 0;
   }
   if (self->flags & DEPTREE_UNRESOLVED)  
   {
     if (!first)
-      fprintf (fp," => not found\n");
+      OutStr (" => not found\n");
     else
-      fprintf (fp, "%s: not found\n", self->module);
+    {
+      OutStr (self->module);
+      OutStr (": not found\n");
+    }
     unresolved = 1;
   }
 
   if (!unresolved && !first && !def_output)
   {
-    if (stricmp (self->module, self->resolved_module) == 0)
-      fprintf (fp," (0x%p)\n", self->mapped_address);
-    else
-      fprintf (fp," => %s (0x%p)\n", self->resolved_module,
-          self->mapped_address);
+    if (stricmp (self->module, self->resolved_module) != 0)
+    {
+      OutStr (" => ");
+      OutStr (self->resolved_module);
+    }
+    OutStr (" (0x");
+    OutPointer (self->mapped_address);
+    OutStr (")\n");
   }
 
   if (list_imports && !def_output)
@@ -204,18 +557,41 @@ EXPORTS\n", mybasename(self->module));
     if(first) first=0;
     for (i = 0; i < self->imports_len; i++)
     {
-      struct ImportTableItem *item = &self->imports[i];
+      struct ImportTableItem *item = GetImport (self, i, &import_view);
       char oaddrx[32], addrx[32];
-      char *p_oaddrx, *p_addrx;
 
-      p_oaddrx = u64tox(item->orig_address, oaddrx, 8);
-      p_addrx = u64tox(item->address, addrx, 8);
-      fprintf (fp,"\t%*s%s %s %3d %s%s %s%s\n", depth, depth > 0 ? " " : "",
-          p_oaddrx, p_addrx, item->ordinal,
-          item->mapped ? "" : "<UNRESOLVED>",
-          item->dll == NULL ? "<MODULE MISSING>" : item->dll->module ? item->dll->module : "<NULL>",
-          item->name ? item->name : (item->ordinal != -1 ? "(imported by ordinal)" : "<NULL>"),
-          item->is_delayed ? " (delayed)" : "");
+      OutChar ('\t');
+      OutIndent (depth);
+      OutStr (u64tox(item->orig_address, oaddrx, 8));
+      OutChar (' ');
+      OutStr (u64tox(item->address, addrx, 8));
+      OutChar (' ');
+      OutDec (item->ordinal, 3);
+      OutChar (' ');
+      if (!item->mapped)
+        OutStr ("<UNRESOLVED>");
+      OutStr (item->dll == NULL ? "<MODULE MISSING>" : item->dll->module ? item->dll->module : "<NULL>");
+      OutChar (' ');
+      OutStr (item->name ? item->name : (item->ordinal != -1 ? "(imported by ordinal)" : "<NULL>"));
+      if (item->mapped && item->mapped->forward_state == FORWARD_DONE)
+      {
+        OutStr (" -> ");
+        OutStr (item->mapped->forward_module->module);
+        OutChar (' ');
+        if (item->mapped->forward->name)
+          OutStr (item->mapped->forward->name);
+        else
+        {
+          OutChar ('#');
+          OutDec (item->mapped->forward->ordinal, 0);
+        }
+      }
+      else if (item->mapped && item->mapped->forward_str)
+      {
+        OutStr (" -> <UNRESOLVED>");
+        OutStr (item->mapped->forward_str);
+      }
+      OutStr (item->is_delayed ? " (delayed)\n" : "\n");
     }
   }
 
@@ -228,7 +604,9 @@ EXPORTS\n", mybasename(self->module));
     {
       if (!(self->childs[i]->flags & DEPTREE_VISITED))
       {
-        fprintf (fp,"\t%*s%s", depth, depth > 0 ? " " : "", self->childs[i]->module);
+        OutChar ('\t');
+        OutIndent (depth);
+        OutStr (self->childs[i]->module);
         PrintImageLinks (0, verbose, unused, datarelocs, functionrelocs, self->childs[i], recursive, list_exports, def_output, list_imports, depth + 1);
       }
     }
@@ -236,33 +614,506 @@ EXPORTS\n", mybasename(self->module));
   return 0;
 }
 
+/* Prints every module that self depends on, directly or not, once.
+ * Imports of top_name, the base name of the module the walk started
+ * from, would be satisfied by that module itself and are left out.
+ */
+void PrintClosure (int verbose, struct DepTreeElement *self, const char *top_name)
+{
+  uint64_t i;
+  self->flags |= DEPTREE_VISITED;
+  for (i = 0; i < self->deps_len; i++)
+  {
+    struct DepTreeElement *dep = self->deps[i];
+    if ((dep->flags & DEPTREE_VISITED) || stricmp (dep->module, top_name) == 0)
+      continue;
+    OutChar ('\t');
+    OutStr (dep->module);
+    PrintImageLinks (0, verbose, 0, 0, 0, dep, 0, 0, 0, 0, 0);
+    PrintClosure (verbose, dep, top_name);
+  }
+}
+
+/* Undoes PrintClosure () without walking the rest of the tree */
+void ClearClosure (struct DepTreeElement *self)
+{
+  uint64_t i;
+  if (!(self->flags & DEPTREE_VISITED))
+    return;
+  self->flags &= ~DEPTREE_VISITED;
+  for (i = 0; i < self->deps_len; i++)
+    ClearClosure (self->deps[i]);
+}
+
+#define OUTPUT_TEXT   0
+#define OUTPUT_JSONL  1
+#define OUTPUT_BINARY 2
+
+/* Binary output starts with BINARY_MAGIC and a u32 version, followed
+ * by records. Each record is a u32 length (of what follows it), a u8
+ * record type and the fields of that type. Integers are little-endian,
+ * and strings are a u32 length followed by that many bytes, with a
+ * missing string written as an empty one.
+ *
+ * BINARY_FILE:   file, u32 machine, u8 found
+ * BINARY_MODULE: u32 depth, parent, name, resolved, u8 found,
+ *                u64 mapped address
+ * BINARY_IMPORT: module, u64 original thunk, u64 thunk, i32 ordinal,
+ *                dll, name, u8 BINARY_IMPORT_* flags, forward dll,
+ *                forward name, u32 forward ordinal
+ * BINARY_EXPORT: module, u32 ordinal, name, u32 address offset,
+ *                forward, i32 section
+ * BINARY_END:    nothing; ends each answer of --serve
+ *
+ * JSON Lines output has one object per record, with a "type" member
+ * of "file", "module", "import", "export" or "end", and otherwise the
+ * same fields. Addresses are hex strings, since they do not always
+ * fit in a double.
+ *
+ * The mapped address of a module is 0 with --cache or --serve, cached
+ * or not, so that both formats come out the same whatever was cached.
+ * It is the only field that differs from a run without a cache.
+ *
+ * The forward fields of an import name the export that a forwarder
+ * it was bound to ends up at, if the chain was followed (with -i);
+ * otherwise they are missing, and the ordinal is 0.
+ */
+#define BINARY_MAGIC   "NTLDDBIN"
+#define BINARY_VERSION 2
+#define BINARY_FILE    1
+#define BINARY_MODULE  2
+#define BINARY_IMPORT  3
+#define BINARY_EXPORT  4
+#define BINARY_END     5
+#define BINARY_IMPORT_MAPPED  0x01
+#define BINARY_IMPORT_DELAYED 0x02
+#define BINARY_IMPORT_NO_DLL  0x04
+
+static DWORD BinStrLen (const char *s)
+{
+  return 4 + (DWORD) (s != NULL ? strlen (s) : 0);
+}
+
+static void OutBinStr (const char *s)
+{
+  DWORD len = s != NULL ? (DWORD) strlen (s) : 0;
+  OutU32LE (len);
+  OutBytes (s, len);
+}
+
+static void OutBinRecord (DWORD len, int type)
+{
+  OutU32LE (len + 1);
+  OutChar ((char) type);
+}
+
+static void OutJsonStr (const char *s)
+{
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *p;
+  if (s == NULL)
+  {
+    OutStr ("null");
+    return;
+  }
+  OutChar ('"');
+  for (p = (const unsigned char *) s; *p; p++)
+  {
+    /* Names are not necessarily UTF-8; bytes above 0x7f are kept as
+     * the Latin-1 characters of the same value
+     */
+    if (*p == '"' || *p == '\\')
+    {
+      OutChar ('\\');
+      OutChar ((char) *p);
+    }
+    else if (*p < 0x20 || *p > 0x7e)
+    {
+      OutStr ("\\u00");
+      OutChar (hex[*p >> 4]);
+      OutChar (hex[*p & 15]);
+    }
+    else
+      OutChar ((char) *p);
+  }
+  OutChar ('"');
+}
+
+static void OutJsonHex (U64_TYPE v)
+{
+  OutStr ("\"0x");
+  OutHex (v, 0);
+  OutChar ('"');
+}
+
+void EmitStart (int format)
+{
+  if (format == OUTPUT_BINARY)
+  {
+    OutBytes (BINARY_MAGIC, 8);
+    OutU32LE (BINARY_VERSION);
+  }
+}
+
+void EmitEnd (int format)
+{
+  if (format == OUTPUT_BINARY)
+    OutBinRecord (0, BINARY_END);
+  else
+    OutStr (format == OUTPUT_JSONL ? "{\"type\":\"end\"}\n" : ".\n");
+}
+
+void EmitFile (int format, char *file, struct DepTreeElement *self)
+{
+  int found = !(self->flags & DEPTREE_UNRESOLVED);
+  if (format == OUTPUT_BINARY)
+  {
+    OutBinRecord (BinStrLen (file) + 5, BINARY_FILE);
+    OutBinStr (file);
+    OutU32LE (self->machineType);
+    OutChar ((char) found);
+    return;
+  }
+  OutStr ("{\"type\":\"file\",\"file\":");
+  OutJsonStr (file);
+  OutStr (",\"machine\":");
+  OutDec (self->machineType, 0);
+  OutStr (found ? ",\"found\":true}\n" : ",\"found\":false}\n");
+}
+
+void EmitModule (int format, struct DepTreeElement *parent, struct DepTreeElement *self, int depth)
+{
+  int found = !(self->flags & DEPTREE_UNRESOLVED);
+  char *resolved = found ? self->resolved_module : NULL;
+  if (format == OUTPUT_BINARY)
+  {
+    OutBinRecord (4 + BinStrLen (parent->module) + BinStrLen (self->module) + BinStrLen (resolved) + 9, BINARY_MODULE);
+    OutU32LE (depth);
+    OutBinStr (parent->module);
+    OutBinStr (self->module);
+    OutBinStr (resolved);
+    OutChar ((char) found);
+    OutU64LE ((U64_TYPE) (uintptr_t) self->mapped_address);
+    return;
+  }
+  OutStr ("{\"type\":\"module\",\"depth\":");
+  OutDec (depth, 0);
+  OutStr (",\"parent\":");
+  OutJsonStr (parent->module);
+  OutStr (",\"name\":");
+  OutJsonStr (self->module);
+  OutStr (",\"resolved\":");
+  OutJsonStr (resolved);
+  OutStr (found ? ",\"found\":true" : ",\"found\":false");
+  OutStr (",\"address\":");
+  OutJsonHex ((U64_TYPE) (uintptr_t) self->mapped_address);
+  OutStr ("}\n");
+}
+
+void EmitImport (int format, struct DepTreeElement *self, struct ImportTableItem *item)
+{
+  char *dll = item->dll != NULL ? item->dll->module : NULL;
+  char *forward_dll = NULL, *forward_name = NULL;
+  int forward_ordinal = 0;
+  if (item->mapped != NULL && item->mapped->forward_state == FORWARD_DONE)
+  {
+    forward_dll = item->mapped->forward_module->module;
+    forward_name = item->mapped->forward->name;
+    forward_ordinal = item->mapped->forward->ordinal;
+  }
+  if (format == OUTPUT_BINARY)
+  {
+    OutBinRecord (BinStrLen (self->module) + 20 + BinStrLen (dll) + BinStrLen (item->name) + 1 +
+        BinStrLen (forward_dll) + BinStrLen (forward_name) + 4, BINARY_IMPORT);
+    OutBinStr (self->module);
+    OutU64LE (item->orig_address);
+    OutU64LE (item->address);
+    OutU32LE ((DWORD) item->ordinal);
+    OutBinStr (dll);
+    OutBinStr (item->name);
+    OutChar ((char) ((item->mapped ? BINARY_IMPORT_MAPPED : 0) |
+        (item->is_delayed ? BINARY_IMPORT_DELAYED : 0) |
+        (item->dll == NULL ? BINARY_IMPORT_NO_DLL : 0)));
+    OutBinStr (forward_dll);
+    OutBinStr (forward_name);
+    OutU32LE ((DWORD) forward_ordinal);
+    return;
+  }
+  OutStr ("{\"type\":\"import\",\"module\":");
+  OutJsonStr (self->module);
+  OutStr (",\"orig_address\":");
+  OutJsonHex (item->orig_address);
+  OutStr (",\"address\":");
+  OutJsonHex (item->address);
+  OutStr (",\"ordinal\":");
+  OutDec (item->ordinal, 0);
+  OutStr (",\"dll\":");
+  OutJsonStr (dll);
+  OutStr (",\"name\":");
+  OutJsonStr (item->name);
+  OutStr (item->mapped ? ",\"mapped\":true" : ",\"mapped\":false");
+  OutStr (item->is_delayed ? ",\"delayed\":true" : ",\"delayed\":false");
+  OutStr (",\"forward_dll\":");
+  OutJsonStr (forward_dll);
+  OutStr (",\"forward_name\":");
+  OutJsonStr (forward_name);
+  OutStr (",\"forward_ordinal\":");
+  OutDec (forward_ordinal, 0);
+  OutStr ("}\n");
+}
+
+void EmitExport (int format, struct DepTreeElement *self, struct ExportTableItem *item)
+{
+  if (format == OUTPUT_BINARY)
+  {
+    OutBinRecord (BinStrLen (self->module) + 4 + BinStrLen (item->name) + 4 + BinStrLen (item->forward_str) + 4, BINARY_EXPORT);
+    OutBinStr (self->module);
+    OutU32LE (item->ordinal);
+    OutBinStr (item->name);
+    OutU32LE (item->address_offset);
+    OutBinStr (item->forward_str);
+    OutU32LE ((DWORD) item->section_index);
+    return;
+  }
+  OutStr ("{\"type\":\"export\",\"module\":");
+  OutJsonStr (self->module);
+  OutStr (",\"ordinal\":");
+  OutDec (item->ordinal, 0);
+  OutStr (",\"name\":");
+  OutJsonStr (item->name);
+  OutStr (",\"address_offset\":");
+  OutJsonHex (item->address_offset);
+  OutStr (",\"forward\":");
+  OutJsonStr (item->forward_str);
+  OutStr (",\"section\":");
+  OutDec (item->section_index, 0);
+  OutStr ("}\n");
+}
+
+/* Walks the tree the way PrintImageLinks () does, emitting records
+ * instead of text
+ */
+void EmitImageLinks (int format, int first, struct DepTreeElement *parent, struct DepTreeElement *self, int recursive, int list_exports, int list_imports, int depth)
+{
+  uint64_t i;
+  struct ExportView export_view;
+  struct ImportView import_view;
+  self->flags |= DEPTREE_VISITED;
+
+  if (list_exports)
+  {
+    for (i = 0; i < self->exports_len; i++)
+      EmitExport (format, self, GetExport (self, i, &export_view));
+    return;
+  }
+  if (!first)
+    EmitModule (format, parent, self, depth);
+  if (list_imports)
+    for (i = 0; i < self->imports_len; i++)
+      EmitImport (format, self, GetImport (self, i, &import_view));
+  if (self->flags & DEPTREE_UNRESOLVED)
+    return;
+  if (first || recursive)
+    for (i = 0; i < self->childs_len; i++)
+      if (!(self->childs[i]->flags & DEPTREE_VISITED))
+        EmitImageLinks (format, 0, self, self->childs[i], recursive, list_exports, list_imports, depth + 1);
+}
+
+/* Like PrintClosure () */
+void EmitClosure (int format, struct DepTreeElement *top, struct DepTreeElement *self, const char *top_name)
+{
+  uint64_t i;
+  self->flags |= DEPTREE_VISITED;
+  for (i = 0; i < self->deps_len; i++)
+  {
+    struct DepTreeElement *dep = self->deps[i];
+    if ((dep->flags & DEPTREE_VISITED) || stricmp (dep->module, top_name) == 0)
+      continue;
+    EmitModule (format, top, dep, 1);
+    EmitClosure (format, top, dep, top_name);
+  }
+}
+
+/* What to do with every file of a run; the session does the rest */
+typedef struct RunOptions_t
+{
+  int verbose;
+  int unused;
+  int list_exports;
+  int list_imports;
+  int def_output;
+  int scan;
+  int format;
+  Session *session;
+} RunOptions;
+
+/* Builds the dependency trees of files and prints them */
+void AnalyseFiles (RunOptions *opt, char **files, int files_count, int multiple)
+{
+  int i;
+  Session *session = opt->session;
+  struct DepTreeElement *root;
+
+  /* Only worth loading more modules for if imports are shown */
+  session->resolve_forwards = opt->list_imports;
+  root = SessionBuildTree (session, files, files_count);
+  if (root == NULL)
+  {
+    fprintf (stderr, "ntldd: out of memory\n");
+    return;
+  }
+  for (i = 0; i < files_count && opt->format != OUTPUT_TEXT; i++)
+  {
+    struct DepTreeElement *child = root->childs[i];
+    EmitFile (opt->format, files[i], child);
+    if (opt->scan && !(child->flags & DEPTREE_UNRESOLVED))
+    {
+      EmitClosure (opt->format, child, child, PathBaseName (files[i]));
+      ClearClosure (child);
+    }
+    else
+      EmitImageLinks (opt->format, 1, NULL, child, session->recursive, opt->list_exports || opt->def_output, opt->list_imports, 0);
+  }
+  for (i = 0; i < files_count && opt->format == OUTPUT_TEXT; i++)
+  {
+    struct DepTreeElement *child = root->childs[i];
+    if (multiple)
+    {
+      OutStr (files[i]);
+      OutStr (" (");
+      OutHex (child->machineType, 4);
+      OutStr ("):\n");
+    }
+    if (opt->scan && !(child->flags & DEPTREE_UNRESOLVED))
+    {
+      PrintClosure (opt->verbose, child, PathBaseName (files[i]));
+      ClearClosure (child);
+    }
+    else
+      PrintImageLinks (1, opt->verbose, opt->unused, session->datarelocs, session->functionrelocs, child, session->recursive, opt->list_exports, opt->def_output, opt->list_imports, 0);
+  }
+  SessionReleaseTree (session);
+}
+
+/* Answers requests from stdin until it is closed. Each request is a
+ * line holding one file name, and is answered as if that file alone
+ * was given on the command line, followed by EmitEnd () (a line
+ * holding a single dot, in text output). Parsed modules are kept
+ * between requests, and only loaded again once their file changes.
+ */
+void Serve (RunOptions *opt)
+{
+  char line[MAX_PATH * 4];
+  Session *session = opt->session;
+
+  while (fgets (line, sizeof (line), stdin) != NULL)
+  {
+    char dir[MAX_PATH];
+    char *name = line;
+    size_t len = strlen (line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+    /* Like a command-line file, the request's own directory is
+     * searched last, and only for this request
+     */
+    mydirname (name, dir);
+    SessionAddSearchPath (session, dir);
+    AnalyseFiles (opt, &name, 1, 0);
+    SessionDropSearchPaths (session, session->searchPaths.count - 1);
+    EmitEnd (opt->format);
+    OutFlush ();
+    fflush (fp);
+  }
+}
+
+static double Percent (uint64_t part, uint64_t whole)
+{
+  return whole > 0 ? part * 100.0 / whole : 0.0;
+}
+
+/* The --stats report, to stderr */
+void PrintStats (Session *session)
+{
+  ImageLoader *loader = &session->loader;
+  uint64_t time;
+  const char *name;
+  int i;
+
+#ifndef NTLDD_NO_STATS
+  static const char *phases[STATS_PHASES] = { "search", "map", "parse", "finddep", "bind" };
+  uint64_t calls;
+  fprintf (stderr, "ntldd: %-8s %12s %12s\n", "phase", "calls", "ms");
+  for (i = 0; i < STATS_PHASES; i++)
+  {
+    GetPhaseStats (session->stats, i, &time, &calls);
+    fprintf (stderr, "ntldd: %-8s %12" I64PF "u %12.3f\n", phases[i], (U64_TYPE) calls, time / 1e6);
+  }
+#else
+  fprintf (stderr, "ntldd: built without per-phase statistics\n");
+#endif
+  fprintf (stderr, "ntldd: %" I64PF "u images loaded, %" I64PF "u bytes mapped, %" I64PF "u bytes read\n",
+      (U64_TYPE) loader->images_loaded, (U64_TYPE) loader->bytes_mapped, (U64_TYPE) loader->bytes_read);
+  fprintf (stderr, "ntldd: search cache: %" I64PF "u hits, %" I64PF "u misses, %.1f%% hit rate\n",
+      (U64_TYPE) session->resolve_hits, (U64_TYPE) session->resolve_misses,
+      Percent (session->resolve_hits, session->resolve_hits + session->resolve_misses));
+  fprintf (stderr, "ntldd: symbols: %" I64PF "u names, %" I64PF "u distinct, %.1f%% repeated, %" I64PF "u bytes in repeats\n",
+      (U64_TYPE) session->symbols_interned, (U64_TYPE) session->symbols_distinct,
+      Percent (session->symbols_interned - session->symbols_distinct, session->symbols_interned),
+      (U64_TYPE) session->symbols_duplicate_bytes);
+  if (session->module_cache)
+  {
+    uint64_t hits, misses;
+    GetModuleCacheStats (session->module_cache, &hits, &misses);
+    fprintf (stderr, "ntldd: module cache: %" I64PF "u hits, %" I64PF "u misses, %.1f%% hit rate\n",
+        (U64_TYPE) hits, (U64_TYPE) misses, Percent (hits, hits + misses));
+  }
+  for (i = 0; GetSlowestModule (session->stats, i, &name, &time); i++)
+  {
+    if (i == 0)
+      fprintf (stderr, "ntldd: slowest modules (ms):\n");
+    fprintf (stderr, "ntldd: %12.3f %s\n", time / 1e6, name);
+  }
+}
+
+/* The benchmark driver defines NTLDD_NO_MAIN and includes this file */
+#ifndef NTLDD_NO_MAIN
 int main (int argc, char **argv)
 {
   int i;
-  int verbose = 0;
-  int unused = 0;
-  int datarelocs = 0;
-  int functionrelocs = 0;
   int skip = 0;
   int files = 0;
-  int recursive = 0;
-  int list_exports = 0;
-  int list_imports = 0;
-  int def_output = 0;
   int files_start = -1;
   int files_count = 0;
+  int serve = 0;
+  char **files_list = NULL;
+  int scanned = 0;
+  char *cache_file = NULL;
+  RunOptions opt;
+  Session *session;
+  SearchPaths *sp;
 
+#ifdef _WIN32
   DWORD winver, isWin32s;
   HMODULE hKernel;
   PVOID oldValue;
+#endif
 
-  SearchPaths sp;
-  memset(&sp, 0, sizeof (sp));
+  session = NewSession ();
+  if (session == NULL)
+  {
+    fprintf (stderr, "ntldd: out of memory\n");
+    return 1;
+  }
+  sp = &session->searchPaths;
+  memset(&opt, 0, sizeof (opt));
+  opt.session = session;
   memset(cTextEditor, 0, MAX_PATH);
-  sp.path = (char**) calloc (1, sizeof (char*));
 
   fp = (FILE*)stdout;
 
+#ifdef _WIN32
   winver = GetVersion();
   isWin32s = ((winver > 0x80000000) && (LOBYTE(LOWORD(winver)) != 4));
 
@@ -273,9 +1124,7 @@ int main (int argc, char **argv)
   if (pGetSystemWow64DirectoryA) {
     char* SysWow64Dir[MAX_PATH];
     if(pGetSystemWow64DirectoryA((LPSTR)SysWow64Dir, MAX_PATH)) { // Get SysWow64 path
-      sp.count ++;
-      sp.path = (char**) realloc(sp.path, sp.count * sizeof(char*));
-      sp.path[sp.count - 1] = strdup((char*) SysWow64Dir);
+      SessionAddSearchPath (session, (char*) SysWow64Dir);
     }
   }
 
@@ -296,32 +1145,33 @@ int main (int argc, char **argv)
     strcpy(cTextEditor, "notepad");
     changeOutputDest();
   }
+#endif
 
   for (i = 1; i < argc; i++)
   {
     if (strcmp (argv[i], "--version") == 0)
       printversion (1);
     else if (strcmp (argv[i], "-v") == 0 || strcmp (argv[i], "--verbose") == 0)
-      verbose = 1;
+      opt.verbose = 1;
     else if (strcmp (argv[i], "-u") == 0 || strcmp (argv[i], "--unused") == 0)
-      unused = 1;
+      opt.unused = 1;
     else if (strcmp (argv[i], "-d") == 0 || 
         strcmp (argv[i], "--data-relocs") == 0)
-      datarelocs = 1;
+      session->datarelocs = 1;
     else if (strcmp (argv[i], "-r") == 0 || 
         strcmp (argv[i], "--function-relocs") == 0)
-      functionrelocs = 1;
+      session->functionrelocs = 1;
     else if (strcmp (argv[i], "-R") == 0 || 
         strcmp (argv[i], "--recursive") == 0)
-      recursive = 1;
+      session->recursive = 1;
     else if (strcmp (argv[i], "-e") == 0 || 
         strcmp (argv[i], "--list-exports") == 0)
-      list_exports = 1;
+      opt.list_exports = 1;
     else if (strcmp (argv[i], "-i") == 0 || 
         strcmp (argv[i], "--list-imports") == 0)
-      list_imports = 1;
+      opt.list_imports = 1;
     else if (strcmp (argv[i], "--def-output") == 0)
-      def_output = 1;
+      opt.def_output = 1;
     else if ((strcmp (argv[i], "-T") == 0 || strcmp (argv[i], "--text-editor") == 0) && i < argc - 1)
     {
       strncpy(cTextEditor, argv[i+1], MAX_PATH - 10/*" ntldd.txt"*/);
@@ -340,15 +1190,13 @@ int main (int argc, char **argv)
       do {
         if (sep)
             *sep = '\0';
-        sp.count++;
-        sp.path = (char**)realloc(sp.path, sp.count * sizeof(char*));
         if (!sep)
         {
           char* p = strrchr(add_dirs, '"');
           if (p)
             *p = '\0';
         }
-        sp.path[sp.count - 1] = strdup(add_dirs);
+        SessionAddSearchPath (session, add_dirs);
         add_dirs = sep + 1;
         if (!sep)
             break;
@@ -356,6 +1204,78 @@ int main (int argc, char **argv)
       } while (1);
       i++;
     }
+    else if (strcmp (argv[i], "--loader") == 0 && i < argc - 1)
+    {
+      ImageLoader *l = GetImageLoader (argv[i+1]);
+      if (l == NULL)
+      {
+        fprintf (fp, "Unknown image loader `%s'\n", argv[i+1]);
+        skip = 1;
+        break;
+      }
+      session->loader = *l;
+      i++;
+    }
+    else if ((strcmp (argv[i], "-j") == 0 || strcmp (argv[i], "--jobs") == 0) && i < argc - 1)
+    {
+      session->jobs = atoi (argv[i+1]);
+      if (session->jobs < 1)
+        session->jobs = 1;
+      i++;
+    }
+    else if (strcmp (argv[i], "--cache") == 0 && i < argc - 1)
+    {
+      cache_file = argv[i+1];
+      i++;
+    }
+    else if (strcmp (argv[i], "--apiset") == 0 && i < argc - 1)
+    {
+      FreeApiSetSchema (session->apiset);
+      session->apiset = LoadApiSetSchema (argv[i+1]);
+      if (session->apiset == NULL)
+      {
+        fprintf (fp, "Could not read an API Set schema from `%s'\n", argv[i+1]);
+        skip = 1;
+        break;
+      }
+      i++;
+    }
+    else if (strcmp (argv[i], "--scan") == 0 && i < argc - 1)
+    {
+      ScanDirectory (argv[i+1], &files_list, &scanned, sp);
+      opt.scan = 1;
+      i++;
+    }
+    else if (strcmp (argv[i], "--serve") == 0)
+      serve = 1;
+    else if (strcmp (argv[i], "--compact") == 0)
+      session->compact = 1;
+    else if (strcmp (argv[i], "--stats") == 0 && session->stats == NULL)
+    {
+      session->stats = NewBuildStats ();
+      if (session->stats == NULL)
+      {
+        fprintf (stderr, "ntldd: out of memory\n");
+        DestroySession (session);
+        return 1;
+      }
+    }
+    else if (strcmp (argv[i], "--format") == 0 && i < argc - 1)
+    {
+      if (strcmp (argv[i+1], "text") == 0)
+        opt.format = OUTPUT_TEXT;
+      else if (strcmp (argv[i+1], "jsonl") == 0)
+        opt.format = OUTPUT_JSONL;
+      else if (strcmp (argv[i+1], "binary") == 0)
+        opt.format = OUTPUT_BINARY;
+      else
+      {
+        fprintf (fp, "Unknown output format `%s'\n", argv[i+1]);
+        skip = 1;
+        break;
+      }
+      i++;
+    }
     else if (strcmp (argv[i], "--help") == 0)
     {
       printversion (0);
@@ -382,65 +1302,110 @@ Try `ntldd --help' for more information\n", argv[i]);
       break;
     }
   }
-  if (!skip && files_start > 0)
+  if (!skip && (serve || files_start > 0 || scanned > 0))
   {
-    int multiple;
-    struct DepTreeElement root;
-    files_count = argc - files_start;
-    sp.count += files_count;
-    sp.path = (char**) realloc(sp.path, sp.count * sizeof(char*));
+    files_count = files_start > 0 ? argc - files_start : 0;
+    for (i = 0; i < files_count; ++i)
+    {
+      char buff[MAX_PATH];
+      mydirname(argv[files_start+i], buff);
+
+      SessionAddSearchPath (session, buff);
+    }
+    /* Files named on the command line come first */
+    files_list = (char **) realloc (files_list, (files_count + scanned + 1) * sizeof (char *));
+    memmove (&files_list[files_count], files_list, scanned * sizeof (char *));
     for (i = 0; i < files_count; ++i)
+      files_list[i] = argv[files_start+i];
+    files_count += scanned;
+    if (opt.scan)
+      session->recursive = 1;
+    if (cache_file)
+      session->module_cache = LoadModuleCache (cache_file);
+    else if (opt.scan || serve)
+      /* Modules that are both scanned and imported by others are
+       * then loaded once, whichever way they are reached first, and
+       * a server only loads modules again once they change
+       */
+      session->module_cache = LoadModuleCache (NULL);
+    if ((cache_file || opt.scan || serve) && session->module_cache == NULL)
+    {
+      fprintf (stderr, "ntldd: out of memory\n");
+      DestroySession (session);
+      return 1;
+    }
+#ifdef _WIN32
+    if (session->apiset == NULL)
+    {
+      char schema[MAX_PATH];
+      UINT len = GetSystemDirectoryA (schema, MAX_PATH);
+      if (len > 0 && len + sizeof ("\\apisetschema.dll") <= MAX_PATH)
+      {
+        strcat (schema, "\\apisetschema.dll");
+        session->apiset = LoadApiSetSchema (schema);
+      }
+    }
+    if (opt.format == OUTPUT_BINARY && fp == stdout)
+      _setmode (_fileno (stdout), _O_BINARY);
+#endif
+    EmitStart (opt.format);
+    if (files_count > 0)
+      AnalyseFiles (&opt, files_list, files_count, files_count > 1 || opt.scan);
+    if (serve)
+      Serve (&opt);
+    OutFlush ();
+    if (cache_file)
+    {
+      if (SaveModuleCache (session->module_cache, cache_file) != 0)
+        fprintf (stderr, "ntldd: could not write %s\n", cache_file);
+    }
+    if (opt.verbose)
     {
-      char *p, buff[MAX_PATH];
-      memset(buff, 0, MAX_PATH);
-      GetFullPathNameA(argv[files_start+i], MAX_PATH, buff, &p);
-      *p = '\0';
-
-      sp.path[sp.count - files_count + i] = strdup(buff);
-    }
-    multiple = files_start + 1 < argc;
-    memset (&root, 0, sizeof (struct DepTreeElement));
-    for (i = files_start; i < argc; i++)
-    {
-      char **stack = NULL;
-      uint64_t stack_len = 0;
-      uint64_t stack_size = 0;
-      BuildTreeConfig cfg;
-      struct DepTreeElement *child = (struct DepTreeElement *) malloc (sizeof (struct DepTreeElement));
-      memset (child, 0, sizeof (struct DepTreeElement));
-      child->module = strdup (argv[i]);
-      AddDep (&root, child);
-      memset(&cfg, 0, sizeof(cfg));
-      cfg.on_self = 0;
-      cfg.datarelocs = datarelocs;
-      cfg.recursive = recursive;
-      cfg.functionrelocs = functionrelocs;
-      cfg.stack = &stack;
-      cfg.stack_len = &stack_len;
-      cfg.stack_size = &stack_size;
-      cfg.searchPaths = &sp;
-      BuildDepTree (&cfg, argv[i], &root, child);
-    }
-    ClearDepStatus (&root, DEPTREE_VISITED | DEPTREE_PROCESSED);
-    for (i = files_start; i < argc; i++)
-    {
-      if (multiple)
-        fprintf (fp,"%s (%04x):\n", argv[i], (root.childs[i - files_start])->machineType);
-      PrintImageLinks (1, verbose, unused, datarelocs, functionrelocs, root.childs[i - files_start], recursive, list_exports, def_output, list_imports, 0);
+      fprintf (stderr, "ntldd: %" I64PF "u processed-module lookups, %" I64PF "u string comparisons saved\n",
+          (U64_TYPE) session->stack_lookups, (U64_TYPE) session->stack_probes_saved);
+      fprintf (stderr, "ntldd: %s loader: %" I64PF "u images, %" I64PF "u bytes mapped, %" I64PF "u bytes read\n",
+          session->loader.name, (U64_TYPE) session->loader.images_loaded, (U64_TYPE) session->loader.bytes_mapped,
+          (U64_TYPE) session->loader.bytes_read);
+      fprintf (stderr, "ntldd: search cache: %" I64PF "u hits, %" I64PF "u misses\n",
+          (U64_TYPE) session->resolve_hits, (U64_TYPE) session->resolve_misses);
+      fprintf (stderr, "ntldd: symbols: %" I64PF "u names, %" I64PF "u distinct, %" I64PF "u bytes in repeats\n",
+          (U64_TYPE) session->symbols_interned, (U64_TYPE) session->symbols_distinct,
+          (U64_TYPE) session->symbols_duplicate_bytes);
+      if (session->module_cache)
+      {
+        uint64_t hits, misses;
+        GetModuleCacheStats (session->module_cache, &hits, &misses);
+        fprintf (stderr, "ntldd: module cache: %" I64PF "u hits, %" I64PF "u misses\n",
+            (U64_TYPE) hits, (U64_TYPE) misses);
+      }
     }
+    if (session->stats)
+      PrintStats (session);
+    for (i = files_count - scanned; i < files_count; i++)
+      free (files_list[i]);
   }
+  DestroySession (session);
+  free (files_list);
 
+#ifdef _WIN32
   if ((pDisableFunc) && (pRevertFunc)) {
     pRevertFunc(oldValue); // Restore the file system redirector
   }
+#endif
 
   if(use_text_editor) {
     fclose(fp);
     strcat(cTextEditor, " ntldd.txt");
+#ifdef _WIN32
     WinExec(cTextEditor, SW_NORMAL);
     Sleep(5000);
+#else
+    if (system(cTextEditor) != 0)
+      fprintf(stderr, "ntldd: failed to run `%s'\n", cTextEditor);
+#endif
     remove("ntldd.txt");
   }
 
   return 0;
 }
+#endif